@@ -0,0 +1,330 @@
+#include <linux/version.h>
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+
+#include "transceive.h"
+
+#ifdef USES_CYCLIC_TX
+
+#include <linux/can/dev.h>
+#include <linux/can/skb.h>
+
+/* Cyclic transmit: frames registered through sysfs are injected into the
+ * channel's txq by an hrtimer. All frames due at the same expiry are
+ * queued before the tty is kicked, so they leave in one write.
+ */
+
+/*---------------------------------------------------------------------------------------------------*/
+/* First due time at or after now on the grid epoch + phase + k * period. */
+static ktime_t emuc_cyclic_due (EMUC_PRIV *priv, EMUC_CYCLIC *c, ktime_t now)
+{
+  s64  period = (s64) c->period * NSEC_PER_USEC;
+  s64  phase  = (s64) c->phase  * NSEC_PER_USEC;
+  s64  t      = ktime_to_ns(ktime_sub(now, priv->cyc_epoch)) - phase;
+  s64  k      = t <= 0 ? 0 : div64_s64(t + period - 1, period);
+
+  return ktime_add_ns(priv->cyc_epoch, phase + k * period);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+/* (Re)program the timer for the earliest entry. Called with info->lock held. */
+static void emuc_cyclic_arm (EMUC_PRIV *priv)
+{
+  ktime_t  next;
+  int      i;
+
+  if(!priv->cyc_cnt)
+    return;
+
+  next = priv->cyc[0].next;
+
+  for(i=1; i<priv->cyc_cnt; i++)
+  {
+    if(ktime_before(priv->cyc[i].next, next))
+      next = priv->cyc[i].next;
+  }
+
+  hrtimer_start(&priv->cyc_timer, next, HRTIMER_MODE_ABS_SOFT);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+static enum hrtimer_restart emuc_cyclic_timer (struct hrtimer *timer)
+{
+  EMUC_PRIV          *priv = container_of(timer, EMUC_PRIV, cyc_timer);
+  EMUC_RAW_INFO      *info = priv->info;
+  struct net_device  *dev;
+  struct sk_buff     *skb;
+  struct can_frame   *cf;
+  ktime_t             now = ktime_get();
+  ktime_t             next = KTIME_MAX;
+  int                 channel, i;
+
+  channel = (netdev_priv(info->devs[0]) == priv) ? 0 : 1;
+  dev = info->devs[channel];
+
+  /* softirq context, like emuc_xmit() */
+  spin_lock(&info->lock);
+
+  /* Queued again by emuc_cyclic_arm() while this waited for the lock. Its
+   * expiry is the earliest of all entries, so it covers the ones due now,
+   * and the expiry of a queued timer must not be changed here.
+   */
+  if(hrtimer_is_queued(timer))
+  {
+    spin_unlock(&info->lock);
+    return HRTIMER_NORESTART;
+  }
+
+  if(!info->tty || !netif_running(dev) || emuc_listen_only(dev) || emuc_bus_off(dev) || !priv->cyc_cnt)
+  {
+    spin_unlock(&info->lock);
+    return HRTIMER_NORESTART;
+  }
+
+  for(i=0; i<priv->cyc_cnt; i++)
+  {
+    EMUC_CYCLIC  *c = &priv->cyc[i];
+
+    if(!ktime_after(c->next, now))
+    {
+      /* a stalled link must not pile up cyclic frames */
+      if(skb_queue_len(&priv->txq) < EMUC_TX_PENDING && (skb = alloc_can_skb(dev, &cf)) != NULL)
+      {
+        *cf = c->cf;
+        emuc_skb_cb(skb)->xmit = now;
+        emuc_tx_enqueue(info, channel, skb);
+      }
+      else
+        dev->stats.tx_dropped++;
+
+      /* missed periods are skipped, not caught up */
+      c->next = emuc_cyclic_due(priv, c, ktime_add_ns(now, 1));
+    }
+
+    if(ktime_before(c->next, next))
+      next = c->next;
+  }
+
+  if(info->xleft <= 0)
+    emuc_tx_next(info);
+
+  hrtimer_set_expires(timer, next);
+  spin_unlock(&info->lock);
+
+  return HRTIMER_RESTART;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+void emuc_cyclic_init (struct net_device *dev)
+{
+  EMUC_PRIV  *priv = netdev_priv(dev);
+
+  hrtimer_init(&priv->cyc_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+  priv->cyc_timer.function = emuc_cyclic_timer;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+/* Interface up: start a new period grid. */
+void emuc_cyclic_start (struct net_device *dev)
+{
+  EMUC_PRIV      *priv = netdev_priv(dev);
+  EMUC_RAW_INFO  *info = priv->info;
+  ktime_t         now = ktime_get();
+  int             i;
+
+  spin_lock_bh(&info->lock);
+
+  priv->cyc_epoch = now;
+
+  for(i=0; i<priv->cyc_cnt; i++)
+    priv->cyc[i].next = emuc_cyclic_due(priv, &priv->cyc[i], now);
+
+  emuc_cyclic_arm(priv);
+  spin_unlock_bh(&info->lock);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+/* Interface down. Must not be called with info->lock held, the timer takes it. */
+void emuc_cyclic_stop (struct net_device *dev)
+{
+  EMUC_PRIV  *priv = netdev_priv(dev);
+
+  hrtimer_cancel(&priv->cyc_timer);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+/* cansend notation: <id>#<data bytes, optionally separated by '.'> or <id>#R */
+static int emuc_cyclic_parse_frame (const char *s, struct can_frame *cf)
+{
+  const char  *p = strchr(s, '#');
+  int          hi, lo;
+
+  memset(cf, 0, sizeof(*cf));
+
+  if(!p || emuc_sysfs_canid(s, p - s, &cf->can_id))
+    return -EINVAL;
+
+  p++;
+
+  if(*p == 'R' || *p == 'r')
+  {
+    cf->can_id |= CAN_RTR_FLAG;
+    return p[1] ? -EINVAL : 0;
+  }
+
+  while(*p)
+  {
+    if(*p == '.')
+    {
+      p++;
+      continue;
+    }
+
+    if(cf->can_dlc == CAN_MAX_DLEN || (hi = hex_to_bin(p[0])) < 0 || (lo = hex_to_bin(p[1])) < 0)
+      return -EINVAL;
+
+    cf->data[cf->can_dlc++] = (hi << 4) | lo;
+    p += 2;
+  }
+
+  return 0;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+static int emuc_cyclic_find (EMUC_PRIV *priv, canid_t id)
+{
+  int  i;
+
+  for(i=0; i<priv->cyc_cnt; i++)
+  {
+    if((priv->cyc[i].cf.can_id & (CAN_EFF_FLAG | CAN_EFF_MASK)) == id)
+      return i;
+  }
+
+  return -1;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+/* Commands written to the cyclic attribute:
+ *   add <frame> <period us> [<phase us>]  add, or replace the entry with the same id
+ *   del <id>
+ *   clear
+ */
+int emuc_cyclic_cmd (struct net_device *dev, const char *buf, size_t count)
+{
+  EMUC_PRIV      *priv = netdev_priv(dev);
+  EMUC_RAW_INFO  *info = priv->info;
+  EMUC_CYCLIC     c;
+  char           *str, *arg[4];
+  int             narg, i, err = -EINVAL;
+  canid_t         id;
+
+  str = kstrndup(buf, count, GFP_KERNEL);
+  if(!str)
+    return -ENOMEM;
+
+  narg = emuc_sysfs_split(str, arg, 4);
+
+  if(narg <= 0)
+    goto OUT;
+
+  if(!strcmp(arg[0], "add") && (narg == 3 || narg == 4))
+  {
+    memset(&c, 0, sizeof(c));
+
+    if(emuc_cyclic_parse_frame(arg[1], &c.cf) || kstrtou32(arg[2], 0, &c.period) ||
+       (narg == 4 && kstrtou32(arg[3], 0, &c.phase)))
+      goto OUT;
+
+    if(c.period < EMUC_CYCLIC_MIN_PERIOD || c.phase >= c.period)
+      goto OUT;
+
+    spin_lock_bh(&info->lock);
+
+    i = emuc_cyclic_find(priv, c.cf.can_id & (CAN_EFF_FLAG | CAN_EFF_MASK));
+    if(i < 0)
+      i = priv->cyc_cnt < EMUC_CYCLIC_MAX ? priv->cyc_cnt++ : -1;
+
+    if(i < 0)
+      err = -ENOSPC;
+    else
+    {
+      c.next = emuc_cyclic_due(priv, &c, ktime_get());
+      priv->cyc[i] = c;
+      err = 0;
+
+      if(netif_running(dev))
+        emuc_cyclic_arm(priv);
+    }
+
+    spin_unlock_bh(&info->lock);
+  }
+  else if(!strcmp(arg[0], "del") && narg == 2)
+  {
+    if(emuc_sysfs_canid(arg[1], strlen(arg[1]), &id))
+      goto OUT;
+
+    spin_lock_bh(&info->lock);
+
+    i = emuc_cyclic_find(priv, id);
+    if(i < 0)
+      err = -ENOENT;
+    else
+    {
+      priv->cyc[i] = priv->cyc[--priv->cyc_cnt];
+      err = 0;
+    }
+
+    spin_unlock_bh(&info->lock);
+  }
+  else if(!strcmp(arg[0], "clear") && narg == 1)
+  {
+    spin_lock_bh(&info->lock);
+    priv->cyc_cnt = 0;
+    spin_unlock_bh(&info->lock);
+    err = 0;
+  }
+
+OUT:
+  kfree(str);
+  return err;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+/* one line per entry: <frame> <period us> <phase us> */
+ssize_t emuc_cyclic_show (struct net_device *dev, char *buf)
+{
+  EMUC_PRIV         *priv = netdev_priv(dev);
+  struct can_frame  *cf;
+  ssize_t            len = 0;
+  int                i, j;
+
+  spin_lock_bh(&priv->info->lock);
+
+  for(i=0; i<priv->cyc_cnt; i++)
+  {
+    cf = &priv->cyc[i].cf;
+
+    len += emuc_sysfs_print_canid(buf + len, cf->can_id);
+    len += sprintf(buf + len, "#");
+
+    if(cf->can_id & CAN_RTR_FLAG)
+      len += sprintf(buf + len, "R");
+    else
+    {
+      for(j=0; j<cf->can_dlc; j++)
+        len += sprintf(buf + len, "%02X", cf->data[j]);
+    }
+
+    len += sprintf(buf + len, " %u %u\n", priv->cyc[i].period, priv->cyc[i].phase);
+  }
+
+  spin_unlock_bh(&priv->info->lock);
+  return len;
+}
+
+#endif /* USES_CYCLIC_TX */
@@ -1,12 +1,16 @@
+#ifdef __KERNEL__
+#include <linux/kernel.h>
 #include <linux/string.h>
 #include <linux/module.h>
+#else
+/* also built into emucd */
+#include <string.h>
 
-#include "emuc_parse.h"
-
-#if _DBG_FUNC
-extern void print_func_trace (int line, const char *func);
+#define ARRAY_SIZE(a)  (sizeof(a) / sizeof((a)[0]))
 #endif
 
+#include "emuc_parse.h"
+
 static void chk_sum_end_byte (unsigned char *frame, int size);
 
 
@@ -16,10 +20,6 @@ void EMUCSendHex (EMUC_CAN_FRAME *frame)
   unsigned char  *p;
   unsigned char   func = 0x00;
 
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
-#endif
-
   p = frame->com_buf;
   memset(p, 0, sizeof(frame->com_buf));
 
@@ -51,20 +51,8 @@ int EMUCRevHex (EMUC_CAN_FRAME *frame)
   unsigned char   chk_sum = 0x00;
   unsigned char  *p;
 
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
-#endif
-
   p = frame->com_buf;
 
-#if _DBG_RECV_HEX
-/*--------------------------------------*/
-  for(i=0; i<COM_BUF_LEN; i++)
-    printk("%02X ", *(p + i));
-  printk("\n");
-/*--------------------------------------*/
-#endif
-
   /* head - byte 0 */
   if(*p != CMD_HEAD_RECV)
     return -1;
@@ -93,14 +81,10 @@ int EMUCRevHex (EMUC_CAN_FRAME *frame)
 } /* END: EMUCRevHex() */
 
 /*---------------------------------------------------------------------------------------*/
-void EMUCInitHex (int sts, unsigned char *cmd)
+void EMUCInitHex (int sts1, int sts2, unsigned char *cmd)
 {
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
-#endif
-
-  *(cmd+1) = sts;
-  *(cmd+2) = sts;
+  *(cmd+1) = sts1;
+  *(cmd+2) = sts2;
   *(cmd+3) = *(cmd+0) + *(cmd+1) + *(cmd+2);
 
   return;
@@ -108,14 +92,196 @@ void EMUCInitHex (int sts, unsigned char *cmd)
 } /* END: EMUCInitHex() */
 
 /*---------------------------------------------------------------------------------------*/
-static void chk_sum_end_byte (unsigned char *frame, int size)
+void EMUCBaudHex (int baud1, int baud2, unsigned char *cmd)
+{
+  *(cmd+0) = CMD_HEAD_BAUD;
+  *(cmd+1) = baud1;
+  *(cmd+2) = baud2;
+
+  chk_sum_end_byte(cmd, 6);
+
+} /* END: EMUCBaudHex() */
+
+/*---------------------------------------------------------------------------------------*/
+static const unsigned int baud_table[][2] =
+{
+  { EMUC_BAUD_100K,  100000 },
+  { EMUC_BAUD_125K,  125000 },
+  { EMUC_BAUD_250K,  250000 },
+  { EMUC_BAUD_400K,  400000 },
+  { EMUC_BAUD_500K,  500000 },
+  { EMUC_BAUD_800K,  800000 },
+  { EMUC_BAUD_1M,   1000000 }
+};
+
+/*---------------------------------------------------------------------------------------*/
+/* bitrate in bit/s to CMD_HEAD_BAUD code, -1 if the device does not support it */
+int EMUCBaudCode (unsigned int bitrate)
+{
+  unsigned int  i;
+
+  for(i=0; i<ARRAY_SIZE(baud_table); i++)
+  {
+    if(baud_table[i][1] == bitrate)
+      return baud_table[i][0];
+  }
+
+  return -1;
+}
+
+/*---------------------------------------------------------------------------------------*/
+/* CMD_HEAD_BAUD code to bitrate in bit/s, 0 if unknown */
+unsigned int EMUCBaudBitrate (int code)
+{
+  unsigned int  i;
+
+  for(i=0; i<ARRAY_SIZE(baud_table); i++)
+  {
+    if((int) baud_table[i][0] == code)
+      return baud_table[i][1];
+  }
+
+  return 0;
+}
+
+/*---------------------------------------------------------------------------------------*/
+/* The command builders below return the length of the command written to cmd. */
+int EMUCModeHex (int mode1, int mode2, unsigned char *cmd)
+{
+  *(cmd+0) = CMD_HEAD_MODE;
+  *(cmd+1) = mode1;
+  *(cmd+2) = mode2;
+
+  chk_sum_end_byte(cmd, 6);
+  return 6;
+
+} /* END: EMUCModeHex() */
+
+/*---------------------------------------------------------------------------------------*/
+int EMUCErrTypeHex (int type, unsigned char *cmd)
+{
+  *(cmd+0) = CMD_HEAD_ERRTYPE;
+  *(cmd+1) = type;
+
+  chk_sum_end_byte(cmd, 5);
+  return 5;
+
+} /* END: EMUCErrTypeHex() */
+
+/*---------------------------------------------------------------------------------------*/
+/* id_type 0 with id and mask 0 clears the filter of the channel */
+int EMUCFilterHex (int CAN_port, int id_type, unsigned int id, unsigned int mask, unsigned char *cmd)
+{
+  int  i;
+
+  memset(cmd, 0, CMD_MAX_LEN);
+
+  *(cmd+0) = CMD_HEAD_FILTER + CAN_port;
+  *(cmd+1) = id_type;
+
+  /* id - byte 2 ~ byte 5, mask - byte 6 ~ byte 9, big endian */
+  for(i=0; i<ID_LEN; i++)
+  {
+    *(cmd+2+i) = (unsigned char) (id   >> (8 * (ID_LEN - 1 - i)));
+    *(cmd+6+i) = (unsigned char) (mask >> (8 * (ID_LEN - 1 - i)));
+  }
+
+  if(mask & 0x10000000)
+    *(cmd+6) = 0x3F;
+
+  chk_sum_end_byte(cmd, CMD_MAX_LEN);
+  return CMD_MAX_LEN;
+
+} /* END: EMUCFilterHex() */
+
+/*---------------------------------------------------------------------------------------*/
+/* commands without arguments: CMD_HEAD_VER, CMD_HEAD_BLDID */
+int EMUCQueryHex (int head, unsigned char *cmd)
+{
+  *(cmd+0) = head;
+
+  chk_sum_end_byte(cmd, 4);
+  return 4;
+
+} /* END: EMUCQueryHex() */
+
+/*---------------------------------------------------------------------------------------*/
+/* length of the reply to a command, 0 if the command has none we know of */
+int EMUCReplyLen (int head)
+{
+  switch(head)
+  {
+    case CMD_HEAD_VER:
+    case CMD_HEAD_BLDID:
+      return CMD_VER_LEN;
+
+    case CMD_HEAD_INIT:
+    case CMD_HEAD_BAUD:
+    case CMD_HEAD_FILTER:
+    case CMD_HEAD_FILTER + 1:
+    case CMD_HEAD_MODE:
+    case CMD_HEAD_ERRTYPE:
+      return CMD_REPLY_LEN;
+
+    default:
+      return 0;
+  }
+
+} /* END: EMUCReplyLen() */
+
+/*---------------------------------------------------------------------------------------*/
+/* Check a reply of len bytes: the status byte, 0 on success, or -1 if it is not a reply. */
+int EMUCReplyHex (const unsigned char *reply, int len)
 {
   int            i;
   unsigned char  chk_sum = 0x00;
 
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
-#endif
+  if(len < CMD_REPLY_LEN || EMUCReplyLen(*reply) != len)
+    return -1;
+
+  for(i=0; i<len-3; i++)
+    chk_sum = chk_sum + *(reply + i);
+
+  if(*(reply + len - 3) != chk_sum || *(reply + len - 2) != 0x0D || *(reply + len - 1) != 0x0A)
+    return -1;
+
+  return *(reply + 1);
+
+} /* END: EMUCReplyHex() */
+
+/*---------------------------------------------------------------------------------------*/
+/* Check a COM_BUF_LEN bytes CMD_HEAD_ERR report and copy the bus error bytes
+ * of both channels to err. Returns the report type or -1 if it is not valid.
+ */
+int EMUCErrHex (const unsigned char *buf, unsigned char err[2][ERR_DATA_LEN])
+{
+  int            i;
+  unsigned char  chk_sum = 0x00;
+
+  if(*buf != CMD_HEAD_ERR)
+    return -1;
+
+  for(i=0; i<COM_BUF_LEN-3; i++)
+    chk_sum = chk_sum + *(buf + i);
+
+  if(chk_sum != *(buf + COM_BUF_LEN - 3))
+    return -1;
+
+  if(*(buf+1) == ERR_TYPE_BUS)
+  {
+    memcpy(err[EMUC_CAN_1], buf + 2, ERR_DATA_LEN);
+    memcpy(err[EMUC_CAN_2], buf + 2 + ERR_DATA_LEN, ERR_DATA_LEN);
+  }
+
+  return *(buf+1);
+
+} /* END: EMUCErrHex() */
+
+/*---------------------------------------------------------------------------------------*/
+static void chk_sum_end_byte (unsigned char *frame, int size)
+{
+  int            i;
+  unsigned char  chk_sum = 0x00;
 
   for(i=0; i<size-3; i++)
     chk_sum = chk_sum + *(frame + i);
@@ -0,0 +1,214 @@
+#include <linux/version.h>
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/kernel.h>
+#include <linux/can/dev.h>
+
+#include "transceive.h"
+
+/* Gateway between the two channels: frames decoded in emuc_bump() that
+ * match a rule of their channel are queued for transmission on the other
+ * channel right away, without a socket hop through userspace or cangw.
+ */
+
+/*---------------------------------------------------------------------------------------------------*/
+/* Called from emuc_bump() for every received frame. */
+void emuc_gw_forward (EMUC_RAW_INFO *info, int channel, const struct can_frame *cf)
+{
+  EMUC_PRIV          *priv = netdev_priv(info->devs[channel]);
+  struct net_device  *out  = info->devs[!channel];
+  EMUC_PRIV          *opriv = netdev_priv(out);
+  EMUC_GW_RULE       *rule = NULL;
+  struct sk_buff     *skb;
+  struct can_frame   *ncf;
+  int                 i;
+
+  if(!priv->gw_cnt)
+    return;
+
+  spin_lock_bh(&info->lock);
+
+  for(i=0; i<priv->gw_cnt; i++)
+  {
+    if((cf->can_id & priv->gw[i].mask) == priv->gw[i].id)
+    {
+      rule = &priv->gw[i];
+      break;
+    }
+  }
+
+  if(!rule)
+    goto OUT;
+
+  if(!info->tty || !netif_running(out) || emuc_listen_only(out) || emuc_bus_off(out) ||
+     skb_queue_len(&opriv->txq) >= EMUC_TX_PENDING)
+  {
+    rule->dropped++;
+    goto OUT;
+  }
+
+  skb = alloc_can_skb(out, &ncf);
+  if(!skb)
+  {
+    rule->dropped++;
+    goto OUT;
+  }
+
+  *ncf = *cf;
+
+  if(rule->to != EMUC_GW_KEEP)
+    ncf->can_id = rule->to | (cf->can_id & CAN_RTR_FLAG);
+
+  rule->frames++;
+  emuc_skb_cb(skb)->xmit = ktime_get();
+  emuc_tx_enqueue(info, !channel, skb);
+
+  if(info->xleft <= 0)
+    emuc_tx_next(info);
+
+OUT:
+  spin_unlock_bh(&info->lock);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+/* <id>:<mask>, id in candump notation, mask in hex */
+static int emuc_gw_parse_filter (const char *s, canid_t *id, canid_t *mask)
+{
+  const char  *p = strchr(s, ':');
+  u32          m;
+
+  if(!p || emuc_sysfs_canid(s, p - s, id) || kstrtou32(p + 1, 16, &m))
+    return -EINVAL;
+
+  *mask = (m & ((*id & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK)) | CAN_EFF_FLAG;
+  *id  &= *mask;
+  return 0;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+static int emuc_gw_find (EMUC_PRIV *priv, canid_t id, canid_t mask)
+{
+  int  i;
+
+  for(i=0; i<priv->gw_cnt; i++)
+  {
+    if(priv->gw[i].id == id && priv->gw[i].mask == mask)
+      return i;
+  }
+
+  return -1;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+/* Commands written to the gateway attribute of the receiving channel:
+ *   add <id>:<mask> [<new id>]  forward matching frames, optionally with a new id
+ *   del <id>:<mask>
+ *   clear
+ * Rules are checked in the order they were added, the first match wins.
+ */
+int emuc_gw_cmd (struct net_device *dev, const char *buf, size_t count)
+{
+  EMUC_PRIV      *priv = netdev_priv(dev);
+  EMUC_RAW_INFO  *info = priv->info;
+  EMUC_GW_RULE    rule;
+  char           *str, *arg[3];
+  int             narg, i, err = -EINVAL;
+
+  str = kstrndup(buf, count, GFP_KERNEL);
+  if(!str)
+    return -ENOMEM;
+
+  narg = emuc_sysfs_split(str, arg, 3);
+
+  if(narg <= 0)
+    goto OUT;
+
+  if(!strcmp(arg[0], "add") && (narg == 2 || narg == 3))
+  {
+    memset(&rule, 0, sizeof(rule));
+    rule.to = EMUC_GW_KEEP;
+
+    if(emuc_gw_parse_filter(arg[1], &rule.id, &rule.mask) ||
+       (narg == 3 && emuc_sysfs_canid(arg[2], strlen(arg[2]), &rule.to)))
+      goto OUT;
+
+    spin_lock_bh(&info->lock);
+
+    i = emuc_gw_find(priv, rule.id, rule.mask);
+    if(i < 0)
+      i = priv->gw_cnt < EMUC_GW_MAX ? priv->gw_cnt++ : -1;
+
+    if(i < 0)
+      err = -ENOSPC;
+    else
+    {
+      priv->gw[i] = rule;
+      err = 0;
+    }
+
+    spin_unlock_bh(&info->lock);
+  }
+  else if(!strcmp(arg[0], "del") && narg == 2)
+  {
+    if(emuc_gw_parse_filter(arg[1], &rule.id, &rule.mask))
+      goto OUT;
+
+    spin_lock_bh(&info->lock);
+
+    i = emuc_gw_find(priv, rule.id, rule.mask);
+    if(i < 0)
+      err = -ENOENT;
+    else
+    {
+      /* keep the order of the remaining rules */
+      memmove(&priv->gw[i], &priv->gw[i + 1], (priv->gw_cnt - i - 1) * sizeof(priv->gw[0]));
+      priv->gw_cnt--;
+      err = 0;
+    }
+
+    spin_unlock_bh(&info->lock);
+  }
+  else if(!strcmp(arg[0], "clear") && narg == 1)
+  {
+    spin_lock_bh(&info->lock);
+    priv->gw_cnt = 0;
+    spin_unlock_bh(&info->lock);
+    err = 0;
+  }
+
+OUT:
+  kfree(str);
+  return err;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+/* one line per rule: <id>:<mask> <new id or -> <forwarded> <dropped> */
+ssize_t emuc_gw_show (struct net_device *dev, char *buf)
+{
+  EMUC_PRIV     *priv = netdev_priv(dev);
+  EMUC_GW_RULE  *rule;
+  ssize_t        len = 0;
+  int            i;
+
+  spin_lock_bh(&priv->info->lock);
+
+  for(i=0; i<priv->gw_cnt; i++)
+  {
+    rule = &priv->gw[i];
+
+    len += emuc_sysfs_print_canid(buf + len, rule->id);
+    len += sprintf(buf + len, ":%X ", rule->mask & CAN_EFF_MASK);
+
+    if(rule->to == EMUC_GW_KEEP)
+      len += sprintf(buf + len, "-");
+    else
+      len += emuc_sysfs_print_canid(buf + len, rule->to);
+
+    len += sprintf(buf + len, " %lu %lu\n", rule->frames, rule->dropped);
+  }
+
+  spin_unlock_bh(&priv->info->lock);
+  return len;
+}
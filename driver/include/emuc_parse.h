@@ -9,8 +9,18 @@
 #define    DATA_LEN_ERR     12
 #define    TIME_CHAR_NUM    13
 #define    CMD_HEAD_INIT    0x61
+#define    CMD_HEAD_BAUD    0x30
+#define    CMD_HEAD_FILTER  0x31   /* 0x32 for the second channel */
+#define    CMD_HEAD_MODE    0x33
+#define    CMD_HEAD_VER     0x35
+#define    CMD_HEAD_BLDID   0x36
+#define    CMD_HEAD_ERRTYPE 0x38
+#define    CMD_REPLY_LEN    5
+#define    CMD_VER_LEN      7      /* reply to CMD_HEAD_VER and CMD_HEAD_BLDID */
+#define    CMD_MAX_LEN      13     /* CMD_HEAD_FILTER */
 #define    CMD_HEAD_SEND    0xE0
 #define    CMD_HEAD_RECV    0xE1
+#define    CMD_HEAD_ERR     0x99   /* error report, COM_BUF_LEN bytes */
 
 /*--------------------------------------*/
 enum
@@ -31,6 +41,49 @@ enum
   EMUC_ACTIVE
 };
 
+enum
+{
+  EMUC_NORMAL = 0,
+  EMUC_LISTEN
+};
+
+/* CMD_HEAD_ERRTYPE */
+enum
+{
+  EMUC_DIS_ALL = 0,
+  EMUC_EE_ERR,
+  EMUC_BUS_ERR,
+  EMUC_EN_ALL = 255
+};
+
+/* CMD_HEAD_ERR reports: byte 1 is the type, a bus error report carries
+ * ERR_DATA_LEN bytes per channel from byte 2 on
+ */
+#define    ERR_TYPE_EEPROM    0x01
+#define    ERR_TYPE_BUS       0x02
+#define    ERR_DATA_LEN       6
+
+#define    ERR_TEC            0      /* transmit error counter */
+#define    ERR_REC            1      /* receive error counter  */
+#define    ERR_FLAGS          2
+
+#define    ERR_FLAG_WARNING   0x01
+#define    ERR_FLAG_PASSIVE   0x02
+#define    ERR_FLAG_BUSOFF    0x04
+#define    ERR_FLAG_OVERFLOW  0x08   /* receive overflow */
+
+/* bitrate codes of CMD_HEAD_BAUD */
+enum
+{
+  EMUC_BAUD_100K = 4,
+  EMUC_BAUD_125K,
+  EMUC_BAUD_250K,
+  EMUC_BAUD_500K,
+  EMUC_BAUD_800K,
+  EMUC_BAUD_1M,
+  EMUC_BAUD_400K
+};
+
 
 /*--------------------------------------*/
 typedef struct
@@ -50,7 +103,17 @@ typedef struct
 /*--------------------------------------*/
 void EMUCSendHex(EMUC_CAN_FRAME *frame);
 int  EMUCRevHex (EMUC_CAN_FRAME *frame);
-void EMUCInitHex(int sts, unsigned char *cmd);
+void EMUCInitHex(int sts1, int sts2, unsigned char *cmd);
+void EMUCBaudHex(int baud1, int baud2, unsigned char *cmd);
+int  EMUCBaudCode(unsigned int bitrate);
+unsigned int EMUCBaudBitrate(int code);
+int  EMUCModeHex   (int mode1, int mode2, unsigned char *cmd);
+int  EMUCErrTypeHex(int type, unsigned char *cmd);
+int  EMUCFilterHex (int CAN_port, int id_type, unsigned int id, unsigned int mask, unsigned char *cmd);
+int  EMUCQueryHex  (int head, unsigned char *cmd);
+int  EMUCReplyLen  (int head);
+int  EMUCReplyHex  (const unsigned char *reply, int len);
+int  EMUCErrHex    (const unsigned char *buf, unsigned char err[2][ERR_DATA_LEN]);
 
 
 
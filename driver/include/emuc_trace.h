@@ -0,0 +1,172 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM emuc
+
+#if !defined(__EMUC_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __EMUC_TRACE_H__
+
+/* Tracepoints in /sys/kernel/tracing/events/emuc/, e.g.
+ *   perf record -e 'emuc:*' -a
+ *   echo 1 > /sys/kernel/tracing/events/emuc/enable
+ * A disabled tracepoint is a patched out branch, they stay in every build.
+ */
+
+#include <linux/tracepoint.h>
+#include <linux/netdevice.h>
+#include <linux/tty.h>
+#include <linux/can.h>
+
+#include "transceive.h"
+
+
+/*--------------------------------------------------------------*/
+/* emuc_receive_buf() got count bytes from the tty's flip buffer work */
+TRACE_EVENT(emuc_rx_buf,
+  TP_PROTO(struct tty_struct *tty, int count),
+  TP_ARGS(tty, count),
+
+  TP_STRUCT__entry(
+    __array(char, tty, IFNAMSIZ)
+    __field(int,  count)
+  ),
+
+  TP_fast_assign(
+    strlcpy(__entry->tty, tty->name, IFNAMSIZ);
+    __entry->count = count;
+  ),
+
+  TP_printk("%s count=%d", __entry->tty, __entry->count)
+);
+
+/*--------------------------------------------------------------*/
+/* a message that did not check out, the parser resyncs after its first byte */
+TRACE_EVENT(emuc_rx_error,
+  TP_PROTO(struct tty_struct *tty, const unsigned char *msg, int len),
+  TP_ARGS(tty, msg, len),
+
+  TP_STRUCT__entry(
+    __array(char,          tty, IFNAMSIZ)
+    __field(int,           len)
+    __array(unsigned char, msg, EMUC_MTU)
+  ),
+
+  TP_fast_assign(
+    strlcpy(__entry->tty, tty->name, IFNAMSIZ);
+    __entry->len = min(len, EMUC_MTU);
+    memcpy(__entry->msg, msg, __entry->len);
+  ),
+
+  TP_printk("%s msg=%s", __entry->tty, __print_hex(__entry->msg, __entry->len))
+);
+
+/*--------------------------------------------------------------*/
+DECLARE_EVENT_CLASS(emuc_frame,
+  TP_PROTO(struct net_device *dev, const struct can_frame *cf),
+  TP_ARGS(dev, cf),
+
+  TP_STRUCT__entry(
+    __array(char,    dev, IFNAMSIZ)
+    __field(canid_t, can_id)
+    __field(u8,      dlc)
+    __array(u8,      data, 8)
+  ),
+
+  TP_fast_assign(
+    strlcpy(__entry->dev, dev->name, IFNAMSIZ);
+    __entry->can_id = cf->can_id;
+    __entry->dlc    = cf->can_dlc;
+    memcpy(__entry->data, cf->data, 8);
+  ),
+
+  TP_printk("%s id=%08X dlc=%u data=%s", __entry->dev, __entry->can_id, __entry->dlc,
+            __print_hex(__entry->data, (__entry->can_id & CAN_RTR_FLAG) ? 0 : min_t(int, __entry->dlc, 8)))
+);
+
+/* a frame received from the device, before the gateway and the delivery */
+DEFINE_EVENT(emuc_frame, emuc_rx_frame,
+  TP_PROTO(struct net_device *dev, const struct can_frame *cf),
+  TP_ARGS(dev, cf)
+);
+
+/* a frame encoded into xbuff */
+DEFINE_EVENT(emuc_frame, emuc_tx_encaps,
+  TP_PROTO(struct net_device *dev, const struct can_frame *cf),
+  TP_ARGS(dev, cf)
+);
+
+/*--------------------------------------------------------------*/
+/* emuc_transmit() runs with xleft bytes left in xbuff */
+TRACE_EVENT(emuc_tx_work,
+  TP_PROTO(struct tty_struct *tty, int xleft),
+  TP_ARGS(tty, xleft),
+
+  TP_STRUCT__entry(
+    __array(char, tty, IFNAMSIZ)
+    __field(int,  xleft)
+  ),
+
+  TP_fast_assign(
+    strlcpy(__entry->tty, tty->name, IFNAMSIZ);
+    __entry->xleft = xleft;
+  ),
+
+  TP_printk("%s xleft=%d", __entry->tty, __entry->xleft)
+);
+
+/*--------------------------------------------------------------*/
+/* the tty took only actual of len bytes, the rest waits for the write wakeup */
+TRACE_EVENT(emuc_tx_partial,
+  TP_PROTO(struct tty_struct *tty, int len, int actual),
+  TP_ARGS(tty, len, actual),
+
+  TP_STRUCT__entry(
+    __array(char, tty, IFNAMSIZ)
+    __field(int,  len)
+    __field(int,  actual)
+  ),
+
+  TP_fast_assign(
+    strlcpy(__entry->tty, tty->name, IFNAMSIZ);
+    __entry->len    = len;
+    __entry->actual = actual;
+  ),
+
+  TP_printk("%s len=%d actual=%d", __entry->tty, __entry->len, __entry->actual)
+);
+
+/*--------------------------------------------------------------*/
+DECLARE_EVENT_CLASS(emuc_queue,
+  TP_PROTO(struct net_device *dev, int pending),
+  TP_ARGS(dev, pending),
+
+  TP_STRUCT__entry(
+    __array(char, dev, IFNAMSIZ)
+    __field(int,  pending)
+  ),
+
+  TP_fast_assign(
+    strlcpy(__entry->dev, dev->name, IFNAMSIZ);
+    __entry->pending = pending;
+  ),
+
+  TP_printk("%s pending=%d", __entry->dev, __entry->pending)
+);
+
+/* the netdev queues of a channel stop or wake, with the frames held by the driver */
+DEFINE_EVENT(emuc_queue, emuc_queue_stop,
+  TP_PROTO(struct net_device *dev, int pending),
+  TP_ARGS(dev, pending)
+);
+
+DEFINE_EVENT(emuc_queue, emuc_queue_wake,
+  TP_PROTO(struct net_device *dev, int pending),
+  TP_ARGS(dev, pending)
+);
+
+#endif /* __EMUC_TRACE_H__ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE emuc_trace
+#include <trace/define_trace.h>
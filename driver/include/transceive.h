@@ -2,9 +2,30 @@
 #define __TRANSCEIVE_H__
 
 
+#include <linux/version.h>
 #include <linux/can.h>
 #include <linux/workqueue.h>
 #include <linux/netdevice.h>
+#include <linux/ktime.h>
+#include <linux/completion.h>
+#include <linux/timer.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+/* pcan_netdev_register() use alloc_candev() instead of alloc_netdev() */
+#define USES_ALLOC_CANDEV
+
+/* using alloc_candev() also means:
+ * - don't care about LINUX_CAN_RESTART_TIMER (restart is handled by can_restart_work)
+ * - netdev_priv() starts with a struct can_priv, so echo skbs are available
+ */
+  #include <linux/can/dev.h>
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+/* cyclic transmit needs hrtimers expiring in softirq context */
+#define USES_CYCLIC_TX
+  #include <linux/hrtimer.h>
+#endif
 
 
 #include "emuc_parse.h"
@@ -14,6 +35,77 @@
 #define   EMUC_MTU    17
 #define   EMUC_MAGIC  0x729B
 
+/* frames held by the driver per channel before the netdev queue stops */
+#define   EMUC_TX_PENDING  16
+
+/* frames gathered into one tty write */
+#define   EMUC_TX_BATCH  16
+
+/* low latency profile: shorter tx batches, tty buffer limit in bytes
+ * instead of the kernel's 64 KB
+ */
+#define   EMUC_TX_LL_BATCH  4
+#define   EMUC_LL_TTY_BUF   8192
+
+/* device command bytes queued ahead of the frames */
+#define   EMUC_CMD_BUF  64
+
+/* device commands waiting for their reply, and how long a reply may take */
+#define   EMUC_CMD_PENDING  8
+#define   EMUC_CMD_TIMEOUT  msecs_to_jiffies(500)
+
+/* latest-value mailbox ids per channel */
+#define   EMUC_TX_MAILBOXES  32
+
+/* upper limit for the tx_queues module parameter */
+#define   EMUC_TX_QUEUES_MAX  8
+
+/* gateway rules per channel */
+#define   EMUC_GW_MAX  32
+
+/* cyclic frames per channel and their shortest period in us */
+#define   EMUC_CYCLIC_MAX        64
+#define   EMUC_CYCLIC_MIN_PERIOD 100
+
+/* latency histogram buckets, 4 per power of two in us: up to 2 s */
+#define   EMUC_LAT_BUCKETS  80
+
+/* latency stages recorded per frame */
+enum
+{
+  EMUC_LAT_RX = 0,                      /* receive_buf() to netif_rx()    */
+  EMUC_LAT_TX_WRITE,                    /* emuc_xmit() to the first write */
+  EMUC_LAT_TX_DONE,                     /* emuc_xmit() to the last byte   */
+  EMUC_LAT_STAGES
+};
+
+/* order of the pending transmit frames of a channel */
+enum
+{
+  EMUC_TX_FIFO = 0,                     /* order of arrival          */
+  EMUC_TX_CANID                         /* CAN arbitration priority  */
+};
+
+
+/*--------------------------------------------------------------*/
+/* caller of emuc_cmd_sync() waiting for a reply */
+typedef struct
+{
+  struct completion  done;
+  unsigned char      reply[CMD_VER_LEN];
+  int                status;   /* reply status byte, -ETIMEDOUT or -ENODEV */
+
+} EMUC_CMD_REQ;
+
+/* command sent to the device, in the order they were queued */
+typedef struct
+{
+  unsigned char      head;
+  unsigned long      expires;  /* jiffies */
+  EMUC_CMD_REQ      *req;      /* NULL: failures are only logged */
+
+} EMUC_CMD_WAIT;
+
 
 /*--------------------------------------------------------------*/
 typedef struct
@@ -25,40 +117,234 @@ typedef struct
   struct net_device  *devs[2];          /* easy for intr handling    */
   spinlock_t          lock;
   struct work_struct  tx_work;          /* Flushes transmit buffer   */
+  struct workqueue_struct *tx_wq;       /* runs tx_work              */
+  struct list_head    list;             /* in emuc_adapters          */
   atomic_t            ref_count;        /* reference count           */
   int                 gif_channel;      /* index for SIOCGIFNAME     */
-  unsigned char       current_channel;  /* Record current channel: for fixing tx_packet bug (v2.2) */
+  char                port[32];         /* parent of the tty, identifies a replugged adapter */
 
   /* These are pointers to the malloc()ed frame buffers. */
   unsigned char       rbuff[EMUC_MTU];  /* receiver buffer           */
   int                 rcount;           /* received chars counter    */
-  unsigned char       xbuff[EMUC_MTU];  /* transmitter buffer        */
+  int                 rlen;             /* length of the message in rbuff */
+  ktime_t             rx_entry;         /* emuc_receive_buf() entry   */
+  ktime_t             rx_start;         /* rx_entry of the first byte in rbuff */
+  unsigned char       xbuff[EMUC_CMD_BUF + EMUC_TX_BATCH * COM_BUF_LEN];  /* transmitter buffer */
   unsigned char      *xhead;            /* pointer to next XMIT byte */
   int                 xleft;            /* bytes left in XMIT queue  */
+  struct sk_buff_head xq;               /* frames in xbuff, echoed once fully written */
+  int                 xdone;            /* frames of xbuff completed */
+  int                 xcmd;             /* command bytes in front of the frames */
+  unsigned char       cbuff[EMUC_CMD_BUF];  /* commands waiting for xbuff */
+  int                 ccount;
+  EMUC_CMD_WAIT       cwait[EMUC_CMD_PENDING];  /* commands waiting for a reply */
+  int                 cwait_cnt;
+  unsigned long       xmit_delay;       /* us between frames, 0: gather frames */
+  int                 baud[2];          /* device bitrate codes, 0: unknown */
+  int                 mode[2];          /* EMUC_NORMAL or EMUC_LISTEN in the device, -1: unknown */
+  int                 err_type;         /* error reports enabled in the device, -1: unknown */
   unsigned long       flags;            /* Flag values/ mode etc     */
+  u32                 tx_seq;           /* enqueue counter, both channels */
+
+  /* transmit stall watchdog, see watchdog.c */
+  struct timer_list   tx_watchdog;
+  struct work_struct  tx_stall_work;    /* sends the stall uevent */
+  unsigned long       tx_progress;      /* jiffies of the last byte taken by the tty */
+  int                 tx_stall_stage;   /* 0: running, 1: write retried, 2: reset pending */
+  int                 tx_stall_event;   /* 1: retry, 2: reset, reported by tx_stall_work */
+  unsigned long       tx_stalls;
+  unsigned long       tx_resets;
 
   #define  SLF_INUSE  0                 /* Channel in use            */
   #define  SLF_ERROR  1                 /* Parity, etc. error        */
+  #define  SLF_DETACHED  2              /* tty gone, netdevs kept for persist */
+  #define  SLF_RESTORED  3              /* reattached, the device runs the previous setup */
+  #define  SLF_LOW_LATENCY  4           /* low latency profile set by emucd */
 
 } EMUC_RAW_INFO;
 
 
 
 /*--------------------------------------------------------------*/
+/* log-linear latency histogram, see latency.c */
 typedef struct
 {
+  u32  cnt[EMUC_LAT_BUCKETS];
+  u64  sum;   /* us */
+  u32  max;   /* us */
+
+} EMUC_LAT_HIST;
+
+
+/*--------------------------------------------------------------*/
+/* frame sent by the driver every period us, at phase us into the period */
+typedef struct
+{
+  struct can_frame  cf;
+  u32               period;
+  u32               phase;
+  ktime_t           next;   /* next due time */
+
+} EMUC_CYCLIC;
+
+
+/*--------------------------------------------------------------*/
+/* frames received on a channel with (can_id & mask) == id are sent on the
+ * other channel, with the id replaced by to unless it is EMUC_GW_KEEP
+ */
+#define   EMUC_GW_KEEP  CAN_ERR_FLAG
+
+typedef struct
+{
+  canid_t        id;
+  canid_t        mask;     /* always includes CAN_EFF_FLAG */
+  canid_t        to;
+  unsigned long  frames;   /* forwarded */
+  unsigned long  dropped;  /* matched but not sent         */
+
+} EMUC_GW_RULE;
+
+
+/*--------------------------------------------------------------*/
+typedef struct
+{
+#ifdef USES_ALLOC_CANDEV
+  struct can_priv  can;    /* must be the first member */
+#endif
   int             magic;
   EMUC_RAW_INFO  *info;    /* just ptr to emuc_info */
+  int             id;      /* emuccan<id>, from emuc_ida */
+
+  /* pending transmit frames, protected by info->lock */
+  struct sk_buff_head  txq;
+  int                  tx_order;  /* EMUC_TX_FIFO or EMUC_TX_CANID */
+
+  /* ids whose pending frame is replaced by a newer one, protected by info->lock */
+  canid_t              tx_mbox[EMUC_TX_MAILBOXES];
+  int                  tx_mbox_cnt;
+  unsigned long        tx_overwrites;
+
+#ifdef USES_ALLOC_CANDEV
+  /* error counters of the last bus error report, protected by info->lock */
+  struct can_berr_counter  bec;
+#endif
+
+  /* acceptance filter in the device, protected by info->lock */
+  canid_t              hw_filter_id;
+  canid_t              hw_filter_mask;   /* 0: no filter */
+
+  /* maximum queueing age in us, 0: no limit */
+  unsigned int         tx_deadline;
+  unsigned long        tx_expired;
+
+  /* gateway to the other channel, protected by info->lock */
+  EMUC_GW_RULE         gw[EMUC_GW_MAX];
+  int                  gw_cnt;
+
+  /* per frame latencies, debugfs */
+  EMUC_LAT_HIST        lat[EMUC_LAT_STAGES];
+  struct dentry       *debugfs;
+
+#ifdef USES_CYCLIC_TX
+  /* cyclic transmit, protected by info->lock */
+  struct hrtimer       cyc_timer;
+  ktime_t              cyc_epoch;  /* start of the period grid */
+  EMUC_CYCLIC          cyc[EMUC_CYCLIC_MAX];
+  int                  cyc_cnt;
+#endif
 
 } EMUC_PRIV;
 
 
+/*--------------------------------------------------------------*/
+/* driver data of a pending frame, kept in skb->cb */
+typedef struct
+{
+  u32      prio;      /* arbitration key: lower wins on the bus */
+  u32      seq;       /* info->tx_seq at enqueue time           */
+  ktime_t  enqueued;  /* for the channel's tx_deadline          */
+  ktime_t  xmit;      /* emuc_xmit() entry, for the histograms  */
+
+} EMUC_SKB_CB;
+
+#define emuc_skb_cb(skb)  ((EMUC_SKB_CB *) (skb)->cb)
+
+
+/*--------------------------------------------------------------*/
+/* the controller is off the bus until it is restarted */
+static inline int emuc_bus_off (struct net_device *dev)
+{
+#ifdef USES_ALLOC_CANDEV
+  return ((EMUC_PRIV *) netdev_priv(dev))->can.state == CAN_STATE_BUS_OFF;
+#else
+  return 0;
+#endif
+}
+
+/*--------------------------------------------------------------*/
+/* CAN_CTRLMODE_LISTENONLY: the channel only receives */
+static inline int emuc_listen_only (struct net_device *dev)
+{
+#ifdef USES_ALLOC_CANDEV
+  return (((EMUC_PRIV *) netdev_priv(dev))->can.ctrlmode & CAN_CTRLMODE_LISTENONLY) != 0;
+#else
+  return 0;
+#endif
+}
+
+
+/*--------------------------------------------------------------*/
+extern const struct attribute_group emuc_sysfs_group;
+
+int emuc_sysfs_canid      (const char *s, size_t len, canid_t *id);
+int emuc_sysfs_print_canid(char *buf, canid_t id);
+int emuc_sysfs_split      (char *str, char **argv, int max);
+
+
 /*--------------------------------------------------------------*/
 void emuc_unesc   (EMUC_RAW_INFO *info, unsigned char s);
-void emuc_bump    (EMUC_RAW_INFO *info);
+int  emuc_bump    (EMUC_RAW_INFO *info);
 void emuc_encaps  (EMUC_RAW_INFO *info, int channel, struct can_frame *cf);
 void emuc_transmit(struct work_struct *work);
-void emuc_initCAN (EMUC_RAW_INFO *info, int sts);
+void emuc_tx_enqueue(EMUC_RAW_INFO *info, int channel, struct sk_buff *skb);
+int  emuc_tx_next (EMUC_RAW_INFO *info);
+void emuc_tx_done (EMUC_RAW_INFO *info);
+void emuc_tx_abort(EMUC_RAW_INFO *info);
+void emuc_tx_purge(EMUC_RAW_INFO *info, int channel);
+void emuc_tx_reorder(EMUC_RAW_INFO *info, int channel);
+int  emuc_cmd_queue(EMUC_RAW_INFO *info, const unsigned char *cmd, int len, EMUC_CMD_REQ *req);
+int  emuc_cmd_sync (EMUC_RAW_INFO *info, const unsigned char *cmd, int len, unsigned char *reply);
+void emuc_cmd_flush(EMUC_RAW_INFO *info);
+int  emuc_cmd_reply(EMUC_RAW_INFO *info);
+void emuc_initCAN (EMUC_RAW_INFO *info, int sts1, int sts2);
+int  emuc_baud    (EMUC_RAW_INFO *info);
+int  emuc_mode    (EMUC_RAW_INFO *info, int channel, int mode);
+int  emuc_err_type(EMUC_RAW_INFO *info, int type);
+int  emuc_error   (EMUC_RAW_INFO *info);
+void emuc_restore (EMUC_RAW_INFO *info);
+void emuc_tx_schedule(EMUC_RAW_INFO *info);
+
+void emuc_watchdog_init(EMUC_RAW_INFO *info);
+void emuc_watchdog_arm (EMUC_RAW_INFO *info);
+void emuc_watchdog_stop(EMUC_RAW_INFO *info);
+
+void    emuc_lat_add       (EMUC_LAT_HIST *h, ktime_t start, ktime_t end);
+void    emuc_debugfs_init  (void);
+void    emuc_debugfs_exit  (void);
+void    emuc_debugfs_add   (struct net_device *dev);
+void    emuc_debugfs_remove(struct net_device *dev);
+
+void    emuc_gw_forward(EMUC_RAW_INFO *info, int channel, const struct can_frame *cf);
+int     emuc_gw_cmd    (struct net_device *dev, const char *buf, size_t count);
+ssize_t emuc_gw_show   (struct net_device *dev, char *buf);
+
+#ifdef USES_CYCLIC_TX
+void    emuc_cyclic_init (struct net_device *dev);
+void    emuc_cyclic_start(struct net_device *dev);
+void    emuc_cyclic_stop (struct net_device *dev);
+int     emuc_cyclic_cmd  (struct net_device *dev, const char *buf, size_t count);
+ssize_t emuc_cyclic_show (struct net_device *dev, char *buf);
+#endif
 
 
 
@@ -0,0 +1,149 @@
+#include <linux/version.h>
+#include <linux/netdevice.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+
+#include "transceive.h"
+
+/* Per frame latency histograms in /sys/kernel/debug/emuc/emuccan<id>/latency,
+ * named after the interface number, which does not change with a rename.
+ * Buckets are log-linear in us: 4 per power of two, so the resolution is
+ * 25% at any latency. Reading prints the non-empty buckets with their
+ * lower bound, writing anything resets all stages.
+ *
+ * The counters are not locked against a reset, which may miss a frame
+ * recorded at the same moment.
+ */
+
+static struct dentry *emuc_debugfs;
+
+static const char *emuc_lat_names[EMUC_LAT_STAGES] =
+{
+  "rx",        /* receive_buf() entry to netif_rx()          */
+  "tx_write",  /* emuc_xmit() entry to the first tty write    */
+  "tx_done",   /* emuc_xmit() entry to the last byte written  */
+};
+
+/*---------------------------------------------------------------------------------------------------*/
+static int emuc_lat_bucket (u32 us)
+{
+  int  e;
+
+  if(us < 4)
+    return us;
+
+  e = ilog2(us);
+  return min((e - 1) * 4 + (int) ((us >> (e - 2)) & 3), EMUC_LAT_BUCKETS - 1);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+/* lowest latency counted in bucket b */
+static u32 emuc_lat_lower (int b)
+{
+  if(b < 4)
+    return b;
+
+  return (4 + (b & 3)) << (b / 4 - 1);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+void emuc_lat_add (EMUC_LAT_HIST *h, ktime_t start, ktime_t end)
+{
+  s64  delta = ktime_us_delta(end, start);
+  u32  us = delta < 0 ? 0 : (u32) min_t(s64, delta, U32_MAX);
+
+  h->cnt[emuc_lat_bucket(us)]++;
+  h->sum += us;
+
+  if(us > h->max)
+    h->max = us;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+static int emuc_lat_show (struct seq_file *m, void *v)
+{
+  struct net_device  *dev  = m->private;
+  EMUC_PRIV          *priv = netdev_priv(dev);
+  EMUC_LAT_HIST      *h;
+  u64                 n;
+  int                 s, b;
+
+  seq_printf(m, "%s\n", dev->name);
+
+  for(s=0; s<EMUC_LAT_STAGES; s++)
+  {
+    h = &priv->lat[s];
+
+    for(n=0, b=0; b<EMUC_LAT_BUCKETS; b++)
+      n += h->cnt[b];
+
+    seq_printf(m, "\n%-9s frames %llu  mean %llu us  max %u us\n", emuc_lat_names[s],
+               n, n ? div64_u64(h->sum, n) : 0, h->max);
+
+    for(b=0; b<EMUC_LAT_BUCKETS; b++)
+    {
+      if(h->cnt[b])
+        seq_printf(m, "  %s%8u us  %10u\n", b == EMUC_LAT_BUCKETS - 1 ? ">=" : "  ",
+                   emuc_lat_lower(b), h->cnt[b]);
+    }
+  }
+
+  return 0;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+static int emuc_lat_open (struct inode *inode, struct file *file)
+{
+  return single_open(file, emuc_lat_show, inode->i_private);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+static ssize_t emuc_lat_write (struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+  struct net_device  *dev = ((struct seq_file *) file->private_data)->private;
+
+  memset(((EMUC_PRIV *) netdev_priv(dev))->lat, 0, sizeof(((EMUC_PRIV *) netdev_priv(dev))->lat));
+  return count;
+}
+
+static const struct file_operations emuc_lat_fops =
+{
+  .owner   = THIS_MODULE,
+  .open    = emuc_lat_open,
+  .read    = seq_read,
+  .write   = emuc_lat_write,
+  .llseek  = seq_lseek,
+  .release = single_release,
+};
+
+/*---------------------------------------------------------------------------------------------------*/
+void emuc_debugfs_init (void)
+{
+  emuc_debugfs = debugfs_create_dir("emuc", NULL);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+void emuc_debugfs_exit (void)
+{
+  debugfs_remove_recursive(emuc_debugfs);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+void emuc_debugfs_add (struct net_device *dev)
+{
+  EMUC_PRIV  *priv = netdev_priv(dev);
+  char        name[IFNAMSIZ];
+
+  snprintf(name, sizeof(name), "emuccan%d", priv->id);
+  priv->debugfs = debugfs_create_dir(name, emuc_debugfs);
+  debugfs_create_file("latency", 0644, priv->debugfs, dev, &emuc_lat_fops);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+void emuc_debugfs_remove (struct net_device *dev)
+{
+  debugfs_remove_recursive(((EMUC_PRIV *) netdev_priv(dev))->debugfs);
+}
@@ -40,6 +40,7 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/tty.h>
+#include <linux/poll.h>
 #include <linux/netdevice.h>
 #include <linux/skbuff.h>
 #include <linux/version.h>
@@ -47,7 +48,10 @@
 #include <linux/if_arp.h>
 #include <linux/delay.h>
 #include <linux/mutex.h>
+#include <linux/idr.h>
+#include <linux/list.h>
 #include <linux/kernel.h>
+#include <linux/ethtool.h>
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 6, 0)
   #include <linux/can/dev.h>
@@ -55,22 +59,21 @@
 
 #include "transceive.h"
 
+#define CREATE_TRACE_POINTS
+#include "emuc_trace.h"
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
   #define N_EMUC (NR_LDISCS - 1)
 #else
   #define N_EMUC N_SLCAN
 #endif
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
-/* pcan_netdev_register() use alloc_candev() instead of alloc_netdev() */
-#define USES_ALLOC_CANDEV
-
-/* using alloc_candev() also means:
- * - don't care about LINUX_CAN_RESTART_TIMER (restart is handled by can_restart_work)
- */
-#endif
-
 #define INNO_XMIT_DELAY_CMD 0x14A9 /* in decimal: 5289 */
+#define INNO_SET_BAUD_CMD   0x14AA /* bitrate codes set by emucd before attaching */
+#define INNO_LOW_LATENCY_CMD 0x14AB /* arg 1: low latency profile on, 0: off */
+
+/* tty buffer limit of the kernel, TTYB_DEFAULT_MEM_LIMIT */
+#define EMUC_TTY_BUF_DEFAULT  65536
 
 /*
  *  v2.1: Joey modify first steady version
@@ -106,11 +109,19 @@ module_exit(emuc_exit);
 /*=====================================================================*/
 static int  emuc_open  (struct tty_struct *tty);
 static void emuc_close (struct tty_struct *tty);
+static void emuc_closed(void);
 static int  emuc_hangup(struct tty_struct *tty);
 static int  emuc_ioctl (struct tty_struct *tty, struct file *file, unsigned int cmd, unsigned long arg);
 static void emuc_receive_buf (struct tty_struct *tty, const unsigned char *cp, char *fp, int count);
 static void emuc_write_wakeup(struct tty_struct *tty);
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,16,0)
+  #define emuc_poll_t  __poll_t
+#else
+  #define emuc_poll_t  unsigned int
+#endif
+static emuc_poll_t emuc_poll(struct tty_struct *tty, struct file *file, poll_table *wait);
+
 static struct tty_ldisc_ops emuc_ldisc =
 {
   .owner  = THIS_MODULE,
@@ -122,6 +133,7 @@ static struct tty_ldisc_ops emuc_ldisc =
   .ioctl  = emuc_ioctl,
   .receive_buf  = emuc_receive_buf,
   .write_wakeup = emuc_write_wakeup,
+  .poll   = emuc_poll,
 };
 
 /* entry (3) */
@@ -130,6 +142,18 @@ static int emuc_netdev_open (struct net_device *dev);
 static int emuc_netdev_close(struct net_device *dev);
 static netdev_tx_t emuc_xmit(struct sk_buff *skb, struct net_device *dev);
 static int emuc_change_mtu  (struct net_device *dev, int new_mtu);
+#ifdef USES_ALLOC_CANDEV
+static u16 emuc_select_queue(struct net_device *dev, struct sk_buff *skb, struct net_device *sb_dev);
+static int emuc_set_bittiming(struct net_device *dev);
+static int emuc_set_mode    (struct net_device *dev, enum can_mode mode);
+static int emuc_get_berr_counter(const struct net_device *dev, struct can_berr_counter *bec);
+
+/* the device only runs at these bitrates */
+static const u32 emuc_bitrate_const[] =
+{
+  100000, 125000, 250000, 400000, 500000, 800000, 1000000
+};
+#endif
 
 static struct net_device_ops emuc_netdev_ops =
 {
@@ -137,24 +161,63 @@ static struct net_device_ops emuc_netdev_ops =
   .ndo_stop       = emuc_netdev_close,
   .ndo_start_xmit = emuc_xmit,
   .ndo_change_mtu = emuc_change_mtu,
+#ifdef USES_ALLOC_CANDEV
+  .ndo_select_queue = emuc_select_queue,
+#endif
+};
+
+/* software tx timestamps: SND in emuc_tx_done(). SCHED is reported by the
+ * stack before the qdisc, the time spent in the driver is in the latency
+ * histograms.
+ */
+static const struct ethtool_ops emuc_ethtool_ops =
+{
+  .get_ts_info = ethtool_op_get_ts_info,
 };
 
 
 static void emuc_sync (void);
+static void emuc_unlink(EMUC_RAW_INFO *info);
+static int  emuc_id_get(void);
+static void emuc_id_put(int id);
 static int  emuc_alloc(dev_t line, EMUC_RAW_INFO *info);
 static void emuc_setup(struct net_device *dev);
 static void emuc_free_netdev(struct net_device *dev);
+static EMUC_RAW_INFO *emuc_find_detached(const char *port);
+static int  emuc_reattach(EMUC_RAW_INFO *info, struct tty_struct *tty);
+static void emuc_detach  (EMUC_RAW_INFO *info);
+static struct workqueue_struct *emuc_tx_wq_alloc(int id);
+static void emuc_low_latency(EMUC_RAW_INFO *info, struct tty_struct *tty, int on);
 
-#if _DBG_FUNC
-void print_func_trace (int line, const char *func); /* extern function */
-#endif
-
-struct mutex xmit_mutex;
-unsigned long xmit_delay = 0;
-int maxdev = 10;
 __initconst const char banner[] = "emuc: EMUC-B202 SocketCAN interface driver\n";
-struct net_device **emuc_devs;
-int netDev_cnt = 0;
+
+/* interface numbers and attached adapters, no fixed limit */
+static DEFINE_IDA(emuc_ida);
+static LIST_HEAD(emuc_adapters);
+static DEFINE_MUTEX(emuc_adapters_lock);
+
+/* attached ldiscs, emuc_exit() waits for their close after the hangup */
+static atomic_t emuc_attached = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(emuc_close_wq);
+
+static unsigned int tx_queues = 1;
+module_param(tx_queues, uint, 0444);
+MODULE_PARM_DESC(tx_queues, "Transmit queues per channel for mqprio, queue 0 has the highest priority (1..8)");
+
+static int tx_cpu = -1;
+module_param(tx_cpu, int, 0444);
+MODULE_PARM_DESC(tx_cpu, "CPU for the transmit worker, -1: any CPU, set cpumask and nice in /sys/devices/virtual/workqueue/emuc_emuccan<N>/");
+
+static bool persist;
+module_param(persist, bool, 0444);
+MODULE_PARM_DESC(persist, "Keep the interfaces of an unplugged adapter without carrier and reattach them when it comes back");
+
+/* per adapter transmit workqueue, high priority instead of the shared system_wq */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
+  #define EMUC_TX_WQ_UNBOUND  (WQ_UNBOUND | WQ_SYSFS)
+#else
+  #define EMUC_TX_WQ_UNBOUND  WQ_UNBOUND
+#endif
 
 
 /*---------------------------------------------------------------------------------------------------*/
@@ -162,22 +225,17 @@ static int __init emuc_init (void)
 {
   int  status;
 
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
-#endif
+  if(tx_cpu >= (int) nr_cpu_ids)
+    tx_cpu = -1;
 
-  mutex_init(&xmit_mutex);
-
-  if(maxdev < 4)
-    maxdev = 4; /* Sanity */
+  #ifdef USES_ALLOC_CANDEV
+  tx_queues = clamp_t(unsigned int, tx_queues, 1, EMUC_TX_QUEUES_MAX);
+  #else
+  tx_queues = 1;
+  #endif
 
   printk(banner);
-  printk(KERN_INFO "emuc: %d dynamic interface channels.\n", maxdev);
-
-  emuc_devs = kzalloc(sizeof(struct net_device *)*maxdev, GFP_KERNEL);
-  
-  if(!emuc_devs)
-    return -ENOMEM;
+  emuc_debugfs_init();
 
   /* Fill in our line protocol discipline, and register it */
   status = tty_register_ldisc(N_EMUC, &emuc_ldisc);
@@ -185,7 +243,7 @@ static int __init emuc_init (void)
   if(status)
   {
     printk(KERN_ERR "emuc: can't register line discipline\n");
-    kfree(emuc_devs);
+    emuc_debugfs_exit();
   }
 
   return status;
@@ -195,84 +253,64 @@ static int __init emuc_init (void)
 static void __exit emuc_exit (void)
 {
   int                 i = 0;
-  int                 busy = 0;
   struct net_device  *dev;
   EMUC_RAW_INFO      *info;
-  unsigned long       timeout = jiffies + HZ;
-
-  xmit_delay = 0;
-  mutex_unlock(&xmit_mutex);
-
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
-#endif
 
-  if(emuc_devs == NULL)
-    return;
+  /* First of all: hangup the active disciplines. */
+  mutex_lock(&emuc_adapters_lock);
 
-  /* First of all: check for active disciplines and hangup them. */   
-  do
+  list_for_each_entry(info, &emuc_adapters, list)
   {
-    if(busy)
-      msleep_interruptible(100);
-
-    busy = 0;
-
-    for(i=0; i<maxdev; i++)
-    {
-      dev = emuc_devs[i];
-
-      if(!dev)
-        continue;
-
-      info = ((EMUC_PRIV *) netdev_priv(dev))->info;
+    spin_lock_bh(&info->lock);
+    if (info->tty)
+      tty_hangup(info->tty);
+    spin_unlock_bh(&info->lock);
+  }
 
-      spin_lock_bh(&info->lock);
-      if (info->tty)
-      {
-        busy++;
-        tty_hangup(info->tty);
-      }
-      spin_unlock_bh(&info->lock);
+  mutex_unlock(&emuc_adapters_lock);
 
-    }
+  /* hangup is async, each emuc_close() reports when it is done */
+  if(!wait_event_timeout(emuc_close_wq, atomic_read(&emuc_attached) == 0, HZ))
+    printk(KERN_ERR "emuc: %d tty disciplines did not close\n", atomic_read(&emuc_attached));
 
-  } while (busy && time_before(jiffies, timeout));
+  mutex_lock(&emuc_adapters_lock);
 
-  /* FIXME: hangup is async so we should wait when doing this second phase */
-  for(i=0; i<maxdev; i++)
+  while(!list_empty(&emuc_adapters))
   {
-    dev = emuc_devs[i];
+    info = list_first_entry(&emuc_adapters, EMUC_RAW_INFO, list);
+    list_del_init(&info->list);
+    mutex_unlock(&emuc_adapters_lock);
 
-    if(!dev)
-      continue;
+    for(i=0; i<2; i++)
+    {
+      dev = info->devs[i];
 
-    emuc_devs[i] = NULL;
+      if(info->tty)
+      {
+        printk(KERN_ERR "%s: tty discipline still running\n", dev->name);
 
-    info = ((EMUC_PRIV *)netdev_priv(dev))->info;
+        /* Intentionally leak the control block. */
 
-    if(info->tty)
-    {
-      printk(KERN_ERR "%s: tty discipline still running\n", dev->name);
-
-      /* Intentionally leak the control block. */
+        #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,9)
+        dev->priv_destructor = NULL;
+        #else
+        dev->destructor = NULL;
+        #endif
+      }
 
-      #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,9)
-      dev->priv_destructor = NULL;
-      #else
-      dev->destructor = NULL;
-      #endif
+    #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 6, 0)
+      unregister_netdev(dev);
+    #else
+      unregister_candev(dev);
+    #endif
     }
 
-  #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 6, 0)
-    unregister_netdev(dev);
-  #else
-    unregister_candev(dev);
-  #endif
+    mutex_lock(&emuc_adapters_lock);
   }
 
-  kfree(emuc_devs);
-  emuc_devs = NULL;
+  mutex_unlock(&emuc_adapters_lock);
+  ida_destroy(&emuc_ida);
+  emuc_debugfs_exit();
 
   i = tty_unregister_ldisc(N_EMUC);
 
@@ -286,37 +324,25 @@ static void emuc_receive_buf (struct tty_struct *tty, const unsigned char *cp, c
 {
   EMUC_RAW_INFO *info = (EMUC_RAW_INFO *) tty->disc_data;
 
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
-#endif
-
-  if(!info || info->magic != EMUC_MAGIC || (!netif_running(info->devs[0]) && !netif_running(info->devs[1])))
+  /* command replies are expected with both channels down too */
+  if(!info || info->magic != EMUC_MAGIC)
     return;
 
-  /* Read the characters out of the buffer */
-  if(count == 5 && *cp == CMD_HEAD_INIT && *(cp+3) == 0x0D && *(cp+4) == 0x0A)  // for send EMUCInitCAN()
-  {
-    if(*(cp+1) == 0x00 && *(cp+2) == (CMD_HEAD_INIT + *(cp+1)))
-      printk(KERN_INFO "emuc: Device set \"active\" successfully.\n");
-    else
-      printk(KERN_INFO "emuc: Device set \"active\" failed.\n");
-    return;
-  }
+  trace_emuc_rx_buf(tty, count);
+  info->rx_entry = ktime_get();
 
-  usleep_range(10, 100);
+  if(!test_bit(SLF_LOW_LATENCY, &info->flags))
+    usleep_range(10, 100);
 
+  /* Read the characters out of the buffer */
   while(count--)
   {
     if (fp && *fp++)
     {
-      if (!test_and_set_bit(SLF_ERROR, &info->flags))
-      {
-        if (netif_running(info->devs[0]))
-          info->devs[0]->stats.rx_errors++;
-
-        if (netif_running(info->devs[1]))
-          info->devs[1]->stats.rx_errors++;
-      }
+      /* drop the partial message, the parser resyncs on the next one */
+      info->rcount = 0;
+      info->devs[0]->stats.rx_errors++;
+      info->devs[1]->stats.rx_errors++;
 
       cp++;
       continue;
@@ -329,12 +355,10 @@ static void emuc_receive_buf (struct tty_struct *tty, const unsigned char *cp, c
 /*---------------------------------------------------------------------------------------------------*/
 static int emuc_open (struct tty_struct *tty)
 {
-  int             err;
-  EMUC_RAW_INFO  *info;
-
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
-#endif
+  int                 i, err;
+  EMUC_RAW_INFO      *info;
+  struct net_device  *devs[2];
+  char                port[sizeof(info->port)];
 
   if (!capable(CAP_NET_ADMIN))
     return -EPERM;
@@ -358,6 +382,20 @@ static int emuc_open (struct tty_struct *tty)
   if(info && info->magic == EMUC_MAGIC)
     goto ERR_EXIT;
 
+  /* the USB interface of the adapter stays the same across a replug, the tty name may not */
+  strlcpy(port, (tty->dev && tty->dev->parent) ? dev_name(tty->dev->parent) : tty->name, sizeof(port));
+
+  /* an adapter unplugged in persist mode gets its interfaces back */
+  info = persist ? emuc_find_detached(port) : NULL;
+  if(info)
+  {
+    err = emuc_reattach(info, tty);
+    if(err)
+      goto ERR_EXIT;
+
+    goto DONE;
+  }
+
   /* OK. Allocate emuc info. */
   err = -ENOMEM;
   info = kzalloc(sizeof(*info), GFP_KERNEL);
@@ -374,23 +412,26 @@ static int emuc_open (struct tty_struct *tty)
 
   info->tty = tty;
   tty->disc_data = info;
+  strlcpy(info->port, port, sizeof(info->port));
 
   if (!test_bit(SLF_INUSE, &info->flags))
   {
     /* Perform the low-level EMUC initialization. */
     info->rcount = 0;
     info->xleft  = 0;
+    info->mode[0] = -1;
+    info->mode[1] = -1;
+    info->err_type = -1;
 
     set_bit(SLF_INUSE, &info->flags);
 
   #ifdef USES_ALLOC_CANDEV
+    /* a pseudo-terminal, e.g. emucsim, has no device to parent the interfaces */
     if(tty->dev)
     {
       SET_NETDEV_DEV(info->devs[0], tty->dev);
       SET_NETDEV_DEV(info->devs[1], tty->dev);
     }
-    else
-      goto ERR_EXIT;
   #endif /* USES_ALLOC_CANDEV */
 
 
@@ -401,16 +442,15 @@ static int emuc_open (struct tty_struct *tty)
     err = register_netdevice(info->devs[1]);
     if(err)
     {
-      #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 6, 0)
-        unregister_netdev(info->devs[0]);
-      #else
-        unregister_candev(info->devs[0]);
-      #endif
+      /* rtnl is held, the destructor runs at rtnl_unlock() */
+      unregister_netdevice(info->devs[0]);
       goto ERR_FREE_CHAN;
     }
   }
 
+DONE:
   /* Done.  We have linked the TTY line to a channel. */
+  atomic_inc(&emuc_attached);
   rtnl_unlock();
   tty->receive_room = 65536;  /* We don't flow control */
 
@@ -421,6 +461,19 @@ ERR_FREE_CHAN:
   info->tty = NULL;
   tty->disc_data = NULL;
   clear_bit(SLF_INUSE, &info->flags);
+  emuc_unlink(info);
+
+  /* netdevs that never got registered have no destructor call coming,
+   * the last one frees info
+   */
+  devs[0] = info->devs[0];
+  devs[1] = info->devs[1];
+
+  for(i=0; i<2; i++)
+  {
+    if(devs[i]->reg_state == NETREG_UNINITIALIZED)
+      emuc_free_netdev(devs[i]);
+  }
 
 ERR_EXIT:
   rtnl_unlock();
@@ -435,20 +488,47 @@ static void emuc_close (struct tty_struct *tty)
 {
   EMUC_RAW_INFO *info = (EMUC_RAW_INFO *) tty->disc_data;
 
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
-#endif
-
   /* First make sure we're connected. */
   if (!info || info->magic != EMUC_MAGIC || info->tty != tty)
     return;
 
+  /* serializes with emuc_open(), which may reattach the adapter */
+  if(persist)
+    rtnl_lock();
+
   spin_lock_bh(&info->lock);
   tty->disc_data = NULL;
   info->tty = NULL;
+  emuc_cmd_flush(info);
+
+  if(persist)
+  {
+    /* frames for the old tty would go out after the reattach setup */
+    info->rcount = 0;
+    info->xleft  = 0;
+    emuc_tx_abort(info);
+    emuc_tx_purge(info, 0);
+    emuc_tx_purge(info, 1);
+    set_bit(SLF_DETACHED, &info->flags);
+  }
+
   spin_unlock_bh(&info->lock);
 
-  flush_work(&info->tx_work);
+  /* the watchdog queues emuc_transmit() */
+  emuc_watchdog_stop(info);
+
+  /* waits for a running emuc_transmit(), the workqueue lives as long as info */
+  cancel_work_sync(&info->tx_work);
+
+  if(persist)
+  {
+    emuc_detach(info);
+    rtnl_unlock();
+    emuc_closed();
+    return;
+  }
+
+  emuc_unlink(info);
 
   /* Flush network side */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 6, 0)
@@ -459,17 +539,23 @@ static void emuc_close (struct tty_struct *tty)
   unregister_candev(info->devs[1]);
 #endif
   /* This will complete via emuc_free_netdev */
+
+  emuc_closed();
 }
 
 
 
 /*---------------------------------------------------------------------------------------------------*/
-static int emuc_hangup (struct tty_struct *tty)
+/* an ldisc is fully closed: its work is flushed and its netdevs are gone or detached */
+static void emuc_closed (void)
 {
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
-#endif
+  if(atomic_dec_and_test(&emuc_attached))
+    wake_up_all(&emuc_close_wq);
+}
 
+/*---------------------------------------------------------------------------------------------------*/
+static int emuc_hangup (struct tty_struct *tty)
+{
   emuc_close(tty);
   return 0;
 }
@@ -481,10 +567,6 @@ static int emuc_ioctl (struct tty_struct *tty, struct file *file, unsigned int c
   unsigned int   tmp;
   EMUC_RAW_INFO *info = (EMUC_RAW_INFO *) tty->disc_data;
 
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
-#endif
-
   /* First make sure we're connected. */
   if (!info || info->magic != EMUC_MAGIC)
     return -EINVAL;
@@ -494,19 +576,54 @@ static int emuc_ioctl (struct tty_struct *tty, struct file *file, unsigned int c
     case INNO_XMIT_DELAY_CMD:
                         {
                           char delay_str[5]; /* 0 ~ 1000 */
+                          unsigned long delay;
 
-                          copy_from_user(delay_str, (void __user *)arg, 5);
+                          if(copy_from_user(delay_str, (void __user *)arg, 5))
+                            return -EFAULT;
                           delay_str[4] = '\0';
-                          kstrtol(delay_str, 10, &xmit_delay);
 
-                          printk("----------> INNO_XMIT_DELAY_CMD ioctl(), xmit_delay = %lu\n", xmit_delay);
-                          if(xmit_delay > 1000)
-                          {
-                            return -1;
-                          }
+                          if(kstrtoul(delay_str, 10, &delay) || delay > 1000)
+                            return -EINVAL;
+
+                          /* per adapter, other adapters keep their pacing */
+                          spin_lock_bh(&info->lock);
+                          info->xmit_delay = delay;
+                          spin_unlock_bh(&info->lock);
+
+                          printk(KERN_INFO "emuc: %s: xmit_delay = %lu\n", tty->name, delay);
+                          return 0;
+                        }
+
+    case INNO_SET_BAUD_CMD:
+                        {
+                          unsigned char baud[2];
+
+                          if(copy_from_user(baud, (void __user *)arg, sizeof(baud)))
+                            return -EFAULT;
+
+                          if(!EMUCBaudBitrate(baud[0]) || !EMUCBaudBitrate(baud[1]))
+                            return -EINVAL;
+
+                          /* reattached: emuc_restore() has set the previous bitrate again */
+                          if(test_bit(SLF_RESTORED, &info->flags))
+                            return 0;
+
+                          /* already configured by emucd, only remember it */
+                          spin_lock_bh(&info->lock);
+                          info->baud[0] = baud[0];
+                          info->baud[1] = baud[1];
+                          #ifdef USES_ALLOC_CANDEV
+                          ((EMUC_PRIV *) netdev_priv(info->devs[0]))->can.bittiming.bitrate = EMUCBaudBitrate(baud[0]);
+                          ((EMUC_PRIV *) netdev_priv(info->devs[1]))->can.bittiming.bitrate = EMUCBaudBitrate(baud[1]);
+                          #endif
+                          spin_unlock_bh(&info->lock);
                           return 0;
                         }
 
+    case INNO_LOW_LATENCY_CMD:
+                        emuc_low_latency(info, tty, arg != 0);
+                        return 0;
+
     case SIOCGIFNAME:
                         {
                           channel = info->gif_channel;
@@ -527,41 +644,109 @@ static int emuc_ioctl (struct tty_struct *tty, struct file *file, unsigned int c
   }
 }
 
+/*---------------------------------------------------------------------------------------------------*/
+/* Low latency profile, set by emucd -L after attaching: received bytes are
+ * parsed as soon as the tty pushes them, the tty buffers only a few ms of
+ * frames instead of queueing stale ones and tx batches are short.
+ */
+static void emuc_low_latency (EMUC_RAW_INFO *info, struct tty_struct *tty, int on)
+{
+  if(on)
+    set_bit(SLF_LOW_LATENCY, &info->flags);
+  else
+    clear_bit(SLF_LOW_LATENCY, &info->flags);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 14, 0)
+  if(tty->port && tty_buffer_set_limit(tty->port, on ? EMUC_LL_TTY_BUF : EMUC_TTY_BUF_DEFAULT))
+    printk(KERN_WARNING "emuc: %s: cannot set the tty buffer limit\n", tty->name);
+#endif
+
+  printk(KERN_INFO "emuc: %s: low latency profile %s\n", tty->name, on ? "on" : "off");
+}
+
 /*---------------------------------------------------------------------------------------------------*/
 static void emuc_write_wakeup (struct tty_struct *tty)
 {
   EMUC_RAW_INFO *info = tty->disc_data;
 
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
-#endif
+  if(!info || info->magic != EMUC_MAGIC)
+    return;
+
+  emuc_tx_schedule(info);
+}
 
-  schedule_work(&info->tx_work);
+/*---------------------------------------------------------------------------------------------------*/
+/* Run emuc_transmit() on the adapter's workqueue, on tx_cpu if it is set. */
+void emuc_tx_schedule (EMUC_RAW_INFO *info)
+{
+  if(tx_cpu >= 0 && cpu_online(tx_cpu))
+    queue_work_on(tx_cpu, info->tx_wq, &info->tx_work);
+  else
+    queue_work(info->tx_wq, &info->tx_work);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+/* Nothing to read, but emucd learns from POLLHUP that the adapter is gone:
+ * the hangup wakes read_wait and the hung up file reports it.
+ */
+static emuc_poll_t emuc_poll (struct tty_struct *tty, struct file *file, poll_table *wait)
+{
+  poll_wait(file, &tty->read_wait, wait);
+  return 0;
 }
 
 /*---------------------------------------------------------------------------------------------------*/
 static int emuc_netdev_open (struct net_device *dev)
 {
   EMUC_RAW_INFO *info = ((EMUC_PRIV *) netdev_priv(dev))->info;
-
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
+#ifdef USES_ALLOC_CANDEV
+  int            err;
 #endif
 
-  if(info->tty == NULL)
+  /* an unplugged adapter in persist mode comes up without carrier, emuc_reattach() sets it up */
+  if(info->tty == NULL && !test_bit(SLF_DETACHED, &info->flags))
     return -ENODEV;
 
-  info->flags &= (1 << SLF_INUSE);
-  netif_start_queue(dev);
+#ifdef USES_ALLOC_CANDEV
+  /* refuses an unknown bitrate and sets the carrier */
+  err = open_candev(dev);
+  if(err)
+    return err;
 
-  netDev_cnt++;
+  if(info->tty == NULL)
+    netif_carrier_off(dev);
+#endif
+
+  clear_bit(SLF_ERROR, &info->flags);
+  netif_tx_start_all_queues(dev);
 
-  if(netDev_cnt == 2)
+#ifdef USES_CYCLIC_TX
+  emuc_cyclic_start(dev);
+#endif
+
+  /* activate the channels of this adapter that are up */
+  spin_lock_bh(&info->lock);
+#ifdef USES_ALLOC_CANDEV
+  /* a detached channel has no controller state until emuc_reattach() */
+  ((EMUC_PRIV *) netdev_priv(dev))->can.state = info->tty ? CAN_STATE_ERROR_ACTIVE : CAN_STATE_STOPPED;
+  memset(&((EMUC_PRIV *) netdev_priv(dev))->bec, 0, sizeof(struct can_berr_counter));
+
+  /* Written ahead of the init command; a lost reply is only logged. The
+   * ctrlmode only changes while the interface is down. Bus error reports
+   * feed the CAN state and the error counters.
+   */
+  if(info->tty)
   {
-    emuc_initCAN(info, EMUC_ACTIVE);
-    printk(KERN_INFO "emuc: Device will become active status.\n");
+    emuc_mode(info, (dev->base_addr & 0xF00) >> 8, emuc_listen_only(dev) ? EMUC_LISTEN : EMUC_NORMAL);
+    emuc_err_type(info, EMUC_EN_ALL);
   }
+#endif
+  if(info->tty)
+    emuc_initCAN(info, netif_running(info->devs[0]) ? EMUC_ACTIVE : EMUC_INACTIVE,
+                       netif_running(info->devs[1]) ? EMUC_ACTIVE : EMUC_INACTIVE);
+  spin_unlock_bh(&info->lock);
 
+  printk(KERN_INFO "%s: channel will become active status.\n", dev->name);
   return 0;
 }
 
@@ -571,10 +756,6 @@ static int emuc_netdev_close (struct net_device *dev)
   int             channel;
   EMUC_RAW_INFO  *info = ((EMUC_PRIV *) netdev_priv(dev))->info;
 
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
-#endif
-
   channel = (dev->base_addr & 0xF00) >> 8;
   if(channel > 1)
   {
@@ -582,6 +763,15 @@ static int emuc_netdev_close (struct net_device *dev)
     return -1;
   }
 
+#ifdef USES_CYCLIC_TX
+  emuc_cyclic_stop(dev);
+#endif
+
+#ifdef USES_ALLOC_CANDEV
+  /* a restart scheduled by can_bus_off() must not bring the channel back */
+  close_candev(dev);
+#endif
+
   spin_lock_bh(&info->lock);
 
   if(info->tty)
@@ -591,15 +781,26 @@ static int emuc_netdev_close (struct net_device *dev)
       clear_bit(TTY_DO_WRITE_WAKEUP, &info->tty->flags);
   }
 
-  netif_stop_queue(dev);
+  netif_tx_stop_all_queues(dev);
+  emuc_tx_purge(info, channel);
 
   if (!netif_running(info->devs[!channel]))
   {
     /* another netdev is closed (down) too, reset TTY buffers. */
     info->rcount   = 0;
     info->xleft    = 0;
+    emuc_tx_abort(info);
   }
 
+#ifdef USES_ALLOC_CANDEV
+  ((EMUC_PRIV *) netdev_priv(dev))->can.state = CAN_STATE_STOPPED;
+#endif
+
+  /* deactivate this channel, the other one keeps its state */
+  if(info->tty)
+    emuc_initCAN(info, netif_running(info->devs[0]) ? EMUC_ACTIVE : EMUC_INACTIVE,
+                       netif_running(info->devs[1]) ? EMUC_ACTIVE : EMUC_INACTIVE);
+
   spin_unlock_bh(&info->lock);
   return 0;
 }
@@ -607,21 +808,9 @@ static int emuc_netdev_close (struct net_device *dev)
 /*---------------------------------------------------------------------------------------------------*/
 static netdev_tx_t emuc_xmit (struct sk_buff *skb, struct net_device *dev)
 {
-  /*======================*/
-  mutex_lock(&xmit_mutex);
-  /*======================*/
-
   int             channel;
-  EMUC_RAW_INFO  *info = ((EMUC_PRIV *) netdev_priv(dev))->info;
-
-  if(xmit_delay)
-  {
-    udelay(xmit_delay);
-  }
-
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
-#endif
+  EMUC_RAW_INFO  *info  = ((EMUC_PRIV *) netdev_priv(dev))->info;
+  ktime_t         entry = ktime_get();  /* latency histograms */
 
   if(skb->len != sizeof(struct can_frame))
     goto OUT;
@@ -650,15 +839,28 @@ static netdev_tx_t emuc_xmit (struct sk_buff *skb, struct net_device *dev)
     goto OUT;
   }
 
-  netif_stop_queue(info->devs[0]);
-  netif_stop_queue(info->devs[1]);
-  emuc_encaps(info, channel, (struct can_frame *) skb->data); /* encaps & send */
+  /* the device does not transmit in listen-only mode */
+  if(emuc_listen_only(dev))
+  {
+    spin_unlock(&info->lock);
+    dev->stats.tx_dropped++;
+    goto OUT;
+  }
+
+  /* The skb is kept until all of its bytes have been written to the tty.
+   * Frames wait in the channel's txq while another frame is in xbuff,
+   * emuc_transmit() picks them up on write wakeup.
+   */
+  emuc_skb_cb(skb)->xmit = entry;
+  emuc_tx_enqueue(info, channel, skb);
+
+  if(info->xleft <= 0)
+    emuc_tx_next(info); /* encaps & send */
+
   spin_unlock(&info->lock);
+  return NETDEV_TX_OK;
 
 OUT:
-  /*======================*/
-  mutex_unlock(&xmit_mutex);
-  /*======================*/
   kfree_skb(skb);
   return NETDEV_TX_OK;
 
@@ -667,77 +869,314 @@ OUT:
 /*---------------------------------------------------------------------------------------------------*/
 static int emuc_change_mtu (struct net_device *dev, int new_mtu)
 {
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
-#endif
-
   return -EINVAL;
 }
 
+#ifdef USES_ALLOC_CANDEV
+/*---------------------------------------------------------------------------------------------------*/
+/* ip link set canX type can bitrate N, the interface is down */
+static int emuc_set_bittiming (struct net_device *dev)
+{
+  int             channel = (dev->base_addr & 0xF00) >> 8;
+  EMUC_PRIV      *priv = netdev_priv(dev);
+  EMUC_RAW_INFO  *info = priv->info;
+  EMUC_PRIV      *other = netdev_priv(info->devs[!channel]);
+  int             code = EMUCBaudCode(priv->can.bittiming.bitrate);
+
+  if(code < 0)
+    return -EINVAL;
+
+  spin_lock_bh(&info->lock);
+
+  if(!info->tty)
+  {
+    spin_unlock_bh(&info->lock);
+    return -ENODEV;
+  }
+
+  info->baud[channel] = code;
+
+  /* the command sets both channels, one with an unknown bitrate follows this one */
+  if(!info->baud[!channel])
+  {
+    info->baud[!channel] = code;
+    other->can.bittiming.bitrate = priv->can.bittiming.bitrate;
+  }
+
+  spin_unlock_bh(&info->lock);
+
+  /* rtnl is held, the reply is short in coming */
+  return emuc_baud(info);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+static int emuc_set_mode (struct net_device *dev, enum can_mode mode)
+{
+  EMUC_PRIV      *priv = netdev_priv(dev);
+  EMUC_RAW_INFO  *info = priv->info;
+
+  switch(mode)
+  {
+    case CAN_MODE_START:
+      /* not reached while detached, emuc_detach() leaves nothing to restart */
+      if(test_bit(SLF_DETACHED, &info->flags))
+        return -ENODEV;
+
+      spin_lock_bh(&info->lock);
+
+      if(info->tty)
+        emuc_initCAN(info, netif_running(info->devs[0]) ? EMUC_ACTIVE : EMUC_INACTIVE,
+                           netif_running(info->devs[1]) ? EMUC_ACTIVE : EMUC_INACTIVE);
+
+      priv->can.state = CAN_STATE_ERROR_ACTIVE;
+      memset(&priv->bec, 0, sizeof(priv->bec));
+      spin_unlock_bh(&info->lock);
+
+      netif_tx_wake_all_queues(dev);
+
+    #ifdef USES_CYCLIC_TX
+      /* the timer stopped at the bus-off */
+      emuc_cyclic_start(dev);
+    #endif
+      return 0;
+
+    default:
+      return -EOPNOTSUPP;
+  }
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+static int emuc_get_berr_counter (const struct net_device *dev, struct can_berr_counter *bec)
+{
+  const EMUC_PRIV  *priv = netdev_priv(dev);
+
+  spin_lock_bh(&priv->info->lock);
+  *bec = priv->bec;
+  spin_unlock_bh(&priv->info->lock);
+
+  return 0;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+static u16 emuc_select_queue (struct net_device *dev, struct sk_buff *skb, struct net_device *sb_dev)
+{
+  /* Without an mqprio mapping all frames share the highest priority
+   * queue, a flow hash would reorder frames arbitrarily.
+   */
+  if(netdev_get_num_tc(dev))
+    return netdev_pick_tx(dev, skb, sb_dev);
+
+  return 0;
+}
+#endif
+
 /*---------------------------------------------------------------------------------------------------*/
 static void emuc_sync (void)
 {
   int                 i;
-  struct net_device  *dev;
   EMUC_RAW_INFO      *info;
 
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
-#endif
+  /* called with rtnl held */
+  mutex_lock(&emuc_adapters_lock);
 
-  for(i=0; i<maxdev; i++)
+  list_for_each_entry(info, &emuc_adapters, list)
   {
-    dev = emuc_devs[i];
+    if(info->tty || test_bit(SLF_DETACHED, &info->flags))
+      continue;
+
+    for(i=0; i<2; i++)
+    {
+      if(info->devs[i]->flags & IFF_UP)
+        dev_close(info->devs[i]);
+    }
+  }
+
+  mutex_unlock(&emuc_adapters_lock);
+}
 
-    if(dev == NULL)
+/*---------------------------------------------------------------------------------------------------*/
+static void emuc_unlink (EMUC_RAW_INFO *info)
+{
+  mutex_lock(&emuc_adapters_lock);
+  list_del_init(&info->list);
+  mutex_unlock(&emuc_adapters_lock);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+/* named after the adapter's first interface as registered, so the sysfs
+ * settings of an unbound one stay with the adapter across a reattach
+ */
+static struct workqueue_struct *emuc_tx_wq_alloc (int id)
+{
+  return alloc_workqueue("emuc_emuccan%d", WQ_HIGHPRI | WQ_MEM_RECLAIM | (tx_cpu < 0 ? EMUC_TX_WQ_UNBOUND : 0),
+                         1, id);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+/* adapter unplugged in persist mode whose tty had the parent port, or NULL */
+static EMUC_RAW_INFO *emuc_find_detached (const char *port)
+{
+  EMUC_RAW_INFO  *info;
+  EMUC_RAW_INFO  *found = NULL;
+
+  mutex_lock(&emuc_adapters_lock);
+
+  list_for_each_entry(info, &emuc_adapters, list)
+  {
+    if(test_bit(SLF_DETACHED, &info->flags) && !strcmp(info->port, port))
+    {
+      found = info;
       break;
+    }
+  }
 
-    info = ((EMUC_PRIV *) netdev_priv(dev))->info;
-    
-    if(info->tty)
-      continue;
+  mutex_unlock(&emuc_adapters_lock);
+  return found;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+/* The tty is gone in persist mode: keep the interfaces registered without
+ * carrier. They move off the tty device, which is about to be removed.
+ * Called with rtnl held.
+ */
+static void emuc_detach (EMUC_RAW_INFO *info)
+{
+  int  i;
+
+  for(i=0; i<2; i++)
+  {
+  #ifdef USES_ALLOC_CANDEV
+    EMUC_PRIV  *priv = netdev_priv(info->devs[i]);
+
+    /* A restart turns the carrier on, with no tty behind it. None stays
+     * scheduled, and can_restart_now() refuses a channel that is not
+     * bus-off.
+     */
+    cancel_delayed_work_sync(&priv->can.restart_work);
 
-    if(dev->flags & IFF_UP)
-      dev_close(dev);
+    spin_lock_bh(&info->lock);
+    priv->can.state = CAN_STATE_STOPPED;
+    spin_unlock_bh(&info->lock);
+  #endif
+
+    netif_carrier_off(info->devs[i]);
+
+  #ifdef USES_ALLOC_CANDEV
+    if(info->devs[i]->dev.parent && device_move(&info->devs[i]->dev, NULL, DPM_ORDER_NONE))
+      printk(KERN_WARNING "%s: cannot move off the tty device\n", info->devs[i]->name);
+  #endif
   }
+
+  printk(KERN_INFO "emuc: %s: adapter gone, keeping %s and %s\n", info->port, info->devs[0]->name, info->devs[1]->name);
 }
 
 /*---------------------------------------------------------------------------------------------------*/
-static int emuc_alloc (dev_t line, EMUC_RAW_INFO *info)
+/* The adapter of a detached info is back on tty: attach it and restore the
+ * previous device setup. Called with rtnl held.
+ */
+static int emuc_reattach (EMUC_RAW_INFO *info, struct tty_struct *tty)
 {
-  int                 i;
-  int                 channel = 0;
-  int                 id[2];
-  char                name[IFNAMSIZ];
-  struct net_device  *dev;
-  struct net_device  *devs[2];
-  EMUC_PRIV          *priv;
+  int  i;
+
+#ifdef USES_ALLOC_CANDEV
+  for(i=0; i<2; i++)
+  {
+    if(tty->dev && device_move(&info->devs[i]->dev, tty->dev, DPM_ORDER_NONE))
+      printk(KERN_WARNING "%s: cannot move to %s\n", info->devs[i]->name, tty->name);
+  }
+#endif
+
+  spin_lock_bh(&info->lock);
 
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
+  info->tty = tty;
+  tty->disc_data = info;
+  info->rcount = 0;
+  info->xleft  = 0;
+  info->gif_channel = 0;
+  info->err_type = -1;
+  clear_bit(SLF_DETACHED, &info->flags);
+  set_bit(SLF_RESTORED, &info->flags);
+
+  /* belongs to the old tty, emucd sets it again */
+  clear_bit(SLF_LOW_LATENCY, &info->flags);
+
+#ifdef USES_ALLOC_CANDEV
+  for(i=0; i<2; i++)
+  {
+    EMUC_PRIV  *priv = netdev_priv(info->devs[i]);
+
+    priv->can.state = netif_running(info->devs[i]) ? CAN_STATE_ERROR_ACTIVE : CAN_STATE_STOPPED;
+    memset(&priv->bec, 0, sizeof(priv->bec));
+  }
 #endif
 
-  for(i=0; i<maxdev; i++)
+  emuc_restore(info);
+  spin_unlock_bh(&info->lock);
+
+  for(i=0; i<2; i++)
   {
-    dev = emuc_devs[i];
+    netif_carrier_on(info->devs[i]);
 
-    if (dev == NULL)
-    {
-      id[channel++] = i;
+    if(!netif_running(info->devs[i]))
+      continue;
 
-      if(channel > 1)
-        break;
-    }
+    netif_tx_wake_all_queues(info->devs[i]);
+
+  #ifdef USES_CYCLIC_TX
+    /* the timer stopped without a tty */
+    emuc_cyclic_start(info->devs[i]);
+  #endif
   }
 
-  /* Sorry, too many, all slots in use */
-  if(i >= maxdev)
+  printk(KERN_INFO "emuc: %s: adapter back on %s, %s and %s reattached\n", info->port, tty->name,
+         info->devs[0]->name, info->devs[1]->name);
+  return 0;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+static int emuc_id_get (void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0)
+  return ida_alloc(&emuc_ida, GFP_KERNEL);
+#else
+  return ida_simple_get(&emuc_ida, 0, 0, GFP_KERNEL);
+#endif
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+static void emuc_id_put (int id)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0)
+  ida_free(&emuc_ida, id);
+#else
+  ida_simple_remove(&emuc_ida, id);
+#endif
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+static int emuc_alloc (dev_t line, EMUC_RAW_INFO *info)
+{
+  int                 id[2];
+  char                name[IFNAMSIZ];
+  struct net_device  *devs[2];
+  EMUC_PRIV          *priv;
+
+  id[0] = emuc_id_get();
+  if(id[0] < 0)
     return -1;
 
+  id[1] = emuc_id_get();
+  if(id[1] < 0)
+    goto ERR_ID;
+
+  info->tx_wq = emuc_tx_wq_alloc(id[0]);
+  if(!info->tx_wq)
+    goto ERR_IDS;
+
   sprintf(name, "emuccan%d", id[0]);
 
   #ifdef USES_ALLOC_CANDEV
-    devs[0] = alloc_candev(sizeof(*priv), 0);
+    devs[0] = alloc_candev_mqs(sizeof(*priv), 1, tx_queues, 1);
   #else
     #if LINUX_VERSION_CODE < KERNEL_VERSION(3,17,0)
       devs[0] = alloc_netdev(sizeof(*priv), name, emuc_setup);
@@ -747,7 +1186,7 @@ static int emuc_alloc (dev_t line, EMUC_RAW_INFO *info)
   #endif /* USES_ALLOC_CANDEV */
   
   if (!devs[0])
-    return -1;
+    goto ERR_WQ;
 
   #ifdef USES_ALLOC_CANDEV
     strncpy(devs[0]->name, name, sizeof(devs[0]->name));
@@ -756,7 +1195,7 @@ static int emuc_alloc (dev_t line, EMUC_RAW_INFO *info)
   sprintf(name, "emuccan%d", id[1]);
   
   #ifdef USES_ALLOC_CANDEV
-    devs[1] = alloc_candev(sizeof(*priv), 0);
+    devs[1] = alloc_candev_mqs(sizeof(*priv), 1, tx_queues, 1);
   #else
     #if LINUX_VERSION_CODE < KERNEL_VERSION(3,17,0)
       devs[1] = alloc_netdev(sizeof(*priv), name, emuc_setup);
@@ -768,22 +1207,32 @@ static int emuc_alloc (dev_t line, EMUC_RAW_INFO *info)
   if (!devs[1])
   {
     free_netdev(devs[0]);
-    return -1; 
+    goto ERR_WQ;
   }
 
   #ifdef USES_ALLOC_CANDEV
     strncpy(devs[1]->name, name, sizeof(devs[1]->name));
   #endif /* USES_ALLOC_CANDEV */
 
-  devs[0]->base_addr = id[0];
-  devs[1]->base_addr = 0x100 | id[1];
+  /* bits 8..11: channel */
+  devs[0]->base_addr = id[0] & 0xFF;
+  devs[1]->base_addr = 0x100 | (id[1] & 0xFF);
 
   priv = netdev_priv(devs[0]);
   priv->magic = EMUC_MAGIC;
   priv->info = info;
+  priv->id = id[0];
+  skb_queue_head_init(&priv->txq);
   priv = netdev_priv(devs[1]);
   priv->magic = EMUC_MAGIC;
   priv->info = info;
+  priv->id = id[1];
+  skb_queue_head_init(&priv->txq);
+
+#ifdef USES_CYCLIC_TX
+  emuc_cyclic_init(devs[0]);
+  emuc_cyclic_init(devs[1]);
+#endif
 
   #ifdef USES_ALLOC_CANDEV
     emuc_setup(devs[0]);
@@ -794,25 +1243,39 @@ static int emuc_alloc (dev_t line, EMUC_RAW_INFO *info)
   info->magic = EMUC_MAGIC;
   info->devs[0] = devs[0];
   info->devs[1] = devs[1];
-  emuc_devs[id[0]] = devs[0];
-  emuc_devs[id[1]] = devs[1];
   spin_lock_init(&info->lock);
+  __skb_queue_head_init(&info->xq);
   atomic_set(&info->ref_count, 2);
   INIT_WORK(&info->tx_work, emuc_transmit);
+  emuc_watchdog_init(info);
+
+  emuc_debugfs_add(devs[0]);
+  emuc_debugfs_add(devs[1]);
+
+  mutex_lock(&emuc_adapters_lock);
+  list_add_tail(&info->list, &emuc_adapters);
+  mutex_unlock(&emuc_adapters_lock);
 
   return 0;
 
+ERR_WQ:
+  destroy_workqueue(info->tx_wq);
+  info->tx_wq = NULL;
+ERR_IDS:
+  emuc_id_put(id[1]);
+ERR_ID:
+  emuc_id_put(id[0]);
+  return -1;
+
 } /* END: emuc_alloc() */
 
 
 /*---------------------------------------------------------------------------------------------------*/
 static void emuc_setup (struct net_device *dev)
 {
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
-#endif
-
-  dev->netdev_ops = &emuc_netdev_ops;
+  dev->netdev_ops  = &emuc_netdev_ops;
+  dev->ethtool_ops = &emuc_ethtool_ops;
+  dev->sysfs_groups[0] = &emuc_sysfs_group;
 
   #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,9)
   dev->priv_destructor = emuc_free_netdev;
@@ -829,34 +1292,43 @@ static void emuc_setup (struct net_device *dev)
 
   /* New-style flags. */
   dev->flags    = IFF_NOARP;
+
+  #ifdef USES_ALLOC_CANDEV
+  /* local echo is generated by emuc_tx_done() once the frame left the tty */
+  dev->flags   |= IFF_ECHO;
+  #endif
   dev->features = NETIF_F_HW_CSUM;
+
+  #ifdef USES_ALLOC_CANDEV
+  {
+    EMUC_PRIV  *priv = netdev_priv(dev);
+
+    priv->can.bitrate_const     = emuc_bitrate_const;
+    priv->can.bitrate_const_cnt = ARRAY_SIZE(emuc_bitrate_const);
+    priv->can.do_set_bittiming  = emuc_set_bittiming;
+    priv->can.do_set_mode       = emuc_set_mode;
+    priv->can.do_get_berr_counter = emuc_get_berr_counter;
+
+    /* the device has no loopback mode */
+    priv->can.ctrlmode_supported = CAN_CTRLMODE_LISTENONLY;
+  }
+  #endif
 }
 
 /*---------------------------------------------------------------------------------------------------*/
 static void emuc_free_netdev (struct net_device *dev)
 {
-  int             i = (dev->base_addr & 0xFF);
+  int             id = ((EMUC_PRIV *) netdev_priv(dev))->id;
   EMUC_RAW_INFO  *info = ((EMUC_PRIV *) netdev_priv(dev))->info;
 
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
-#endif
-
+  emuc_debugfs_remove(dev);
   free_netdev(dev);
 
-  emuc_devs[i] = NULL;
+  emuc_id_put(id);
 
   if(atomic_dec_and_test(&info->ref_count))
   {
-    printk("free_netdev: free info\n");
+    destroy_workqueue(info->tx_wq);
     kfree(info);
   }
 }
-
-#if _DBG_FUNC
-/*---------------------------------------------------------------------------------------------------*/
-void print_func_trace (int line, const char *func)
-{
-  printk("----------------> %d, %s()\n", line, func);
-}
-#endif
@@ -0,0 +1,395 @@
+#include <linux/version.h>
+#include <linux/netdevice.h>
+#include <linux/device.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/can.h>
+
+#include "transceive.h"
+
+/* sysfs attributes in /sys/class/net/emuccanX/emuc/ */
+
+static const char *emuc_tx_order_names[] = { "fifo", "canid" };
+
+/*---------------------------------------------------------------------------------------------------*/
+static int emuc_sysfs_channel (struct net_device *dev)
+{
+  return (dev->base_addr & 0xF00) >> 8;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+/* CAN id in candump notation: 3 hex digits standard, 8 hex digits extended frame format */
+int emuc_sysfs_canid (const char *s, size_t len, canid_t *id)
+{
+  unsigned int  v = 0;
+  size_t        i;
+  int           d;
+
+  if(len != 3 && len != 8)
+    return -EINVAL;
+
+  for(i=0; i<len; i++)
+  {
+    if((d = hex_to_bin(s[i])) < 0)
+      return -EINVAL;
+    v = (v << 4) | d;
+  }
+
+  if(len == 8)
+  {
+    if(v > CAN_EFF_MASK)
+      return -EINVAL;
+    *id = v | CAN_EFF_FLAG;
+  }
+  else
+  {
+    if(v > CAN_SFF_MASK)
+      return -EINVAL;
+    *id = v;
+  }
+
+  return 0;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+int emuc_sysfs_print_canid (char *buf, canid_t id)
+{
+  if(id & CAN_EFF_FLAG)
+    return sprintf(buf, "%08X", id & CAN_EFF_MASK);
+
+  return sprintf(buf, "%03X", id & CAN_SFF_MASK);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+/* Split a command written to an attribute into words, in place. Returns
+ * the number of words or -EINVAL if there are more than max.
+ */
+int emuc_sysfs_split (char *str, char **argv, int max)
+{
+  char  *tok;
+  int    argc = 0;
+
+  while((tok = strsep(&str, " \t\n")) != NULL)
+  {
+    if(!*tok)
+      continue;
+
+    if(argc == max)
+      return -EINVAL;
+
+    argv[argc++] = tok;
+  }
+
+  return argc;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+static ssize_t tx_order_show (struct device *d, struct device_attribute *attr, char *buf)
+{
+  EMUC_PRIV  *priv = netdev_priv(to_net_dev(d));
+
+  return sprintf(buf, "%s\n", emuc_tx_order_names[priv->tx_order]);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+static ssize_t tx_order_store (struct device *d, struct device_attribute *attr, const char *buf, size_t count)
+{
+  struct net_device  *dev  = to_net_dev(d);
+  EMUC_PRIV          *priv = netdev_priv(dev);
+  EMUC_RAW_INFO      *info = priv->info;
+  unsigned int        order;
+
+  for(order=0; order<ARRAY_SIZE(emuc_tx_order_names); order++)
+  {
+    if(sysfs_streq(buf, emuc_tx_order_names[order]))
+      break;
+  }
+
+  if(order == ARRAY_SIZE(emuc_tx_order_names))
+    return -EINVAL;
+
+  spin_lock_bh(&info->lock);
+
+  if(priv->tx_order != (int) order)
+  {
+    priv->tx_order = order;
+    emuc_tx_reorder(info, emuc_sysfs_channel(dev));
+  }
+
+  spin_unlock_bh(&info->lock);
+  return count;
+}
+
+static DEVICE_ATTR_RW(tx_order);
+
+/*---------------------------------------------------------------------------------------------------*/
+/* mailbox ids in candump notation: 3 hex digits standard, 8 hex digits extended frame format */
+static ssize_t tx_mailboxes_show (struct device *d, struct device_attribute *attr, char *buf)
+{
+  EMUC_PRIV  *priv = netdev_priv(to_net_dev(d));
+  ssize_t     len  = 0;
+  int         i;
+
+  spin_lock_bh(&priv->info->lock);
+
+  for(i=0; i<priv->tx_mbox_cnt; i++)
+  {
+    if(i)
+      len += sprintf(buf + len, " ");
+    len += emuc_sysfs_print_canid(buf + len, priv->tx_mbox[i]);
+  }
+
+  spin_unlock_bh(&priv->info->lock);
+
+  len += sprintf(buf + len, "\n");
+  return len;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+static ssize_t tx_mailboxes_store (struct device *d, struct device_attribute *attr, const char *buf, size_t count)
+{
+  EMUC_PRIV     *priv = netdev_priv(to_net_dev(d));
+  canid_t        ids[EMUC_TX_MAILBOXES];
+  int            cnt = 0;
+  char          *str, *p, *tok;
+
+  str = kstrndup(buf, count, GFP_KERNEL);
+  if(!str)
+    return -ENOMEM;
+
+  p = str;
+  while((tok = strsep(&p, " ,\t\n")) != NULL)
+  {
+    if(!*tok)
+      continue;
+
+    if(cnt == EMUC_TX_MAILBOXES || emuc_sysfs_canid(tok, strlen(tok), &ids[cnt]))
+      goto INVAL;
+
+    cnt++;
+  }
+
+  kfree(str);
+
+  spin_lock_bh(&priv->info->lock);
+  memcpy(priv->tx_mbox, ids, cnt * sizeof(ids[0]));
+  priv->tx_mbox_cnt = cnt;
+  spin_unlock_bh(&priv->info->lock);
+
+  return count;
+
+INVAL:
+  kfree(str);
+  return -EINVAL;
+}
+
+static DEVICE_ATTR_RW(tx_mailboxes);
+
+/*---------------------------------------------------------------------------------------------------*/
+static ssize_t tx_overwrites_show (struct device *d, struct device_attribute *attr, char *buf)
+{
+  EMUC_PRIV  *priv = netdev_priv(to_net_dev(d));
+
+  return sprintf(buf, "%lu\n", priv->tx_overwrites);
+}
+
+static DEVICE_ATTR_RO(tx_overwrites);
+
+/*---------------------------------------------------------------------------------------------------*/
+static ssize_t tx_deadline_us_show (struct device *d, struct device_attribute *attr, char *buf)
+{
+  EMUC_PRIV  *priv = netdev_priv(to_net_dev(d));
+
+  return sprintf(buf, "%u\n", priv->tx_deadline);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+static ssize_t tx_deadline_us_store (struct device *d, struct device_attribute *attr, const char *buf, size_t count)
+{
+  EMUC_PRIV     *priv = netdev_priv(to_net_dev(d));
+  unsigned int   us;
+
+  if(kstrtouint(buf, 0, &us))
+    return -EINVAL;
+
+  spin_lock_bh(&priv->info->lock);
+  priv->tx_deadline = us;
+  spin_unlock_bh(&priv->info->lock);
+
+  return count;
+}
+
+static DEVICE_ATTR_RW(tx_deadline_us);
+
+/*---------------------------------------------------------------------------------------------------*/
+static ssize_t tx_expired_show (struct device *d, struct device_attribute *attr, char *buf)
+{
+  EMUC_PRIV  *priv = netdev_priv(to_net_dev(d));
+
+  return sprintf(buf, "%lu\n", priv->tx_expired);
+}
+
+static DEVICE_ATTR_RO(tx_expired);
+
+/*---------------------------------------------------------------------------------------------------*/
+/* transmit stalls of the adapter, the same on both channels */
+static ssize_t tx_stalls_show (struct device *d, struct device_attribute *attr, char *buf)
+{
+  EMUC_PRIV  *priv = netdev_priv(to_net_dev(d));
+
+  return sprintf(buf, "%lu\n", priv->info->tx_stalls);
+}
+
+static DEVICE_ATTR_RO(tx_stalls);
+
+/*---------------------------------------------------------------------------------------------------*/
+static ssize_t tx_resets_show (struct device *d, struct device_attribute *attr, char *buf)
+{
+  EMUC_PRIV  *priv = netdev_priv(to_net_dev(d));
+
+  return sprintf(buf, "%lu\n", priv->info->tx_resets);
+}
+
+static DEVICE_ATTR_RO(tx_resets);
+
+/*---------------------------------------------------------------------------------------------------*/
+static ssize_t gateway_show (struct device *d, struct device_attribute *attr, char *buf)
+{
+  return emuc_gw_show(to_net_dev(d), buf);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+static ssize_t gateway_store (struct device *d, struct device_attribute *attr, const char *buf, size_t count)
+{
+  int  err = emuc_gw_cmd(to_net_dev(d), buf, count);
+
+  return err ? err : (ssize_t) count;
+}
+
+static DEVICE_ATTR_RW(gateway);
+
+/*---------------------------------------------------------------------------------------------------*/
+/* acceptance filter of the device: <id>:<mask> as for the gateway, or none */
+static ssize_t filter_show (struct device *d, struct device_attribute *attr, char *buf)
+{
+  EMUC_PRIV  *priv = netdev_priv(to_net_dev(d));
+  ssize_t     len;
+
+  spin_lock_bh(&priv->info->lock);
+
+  if(!priv->hw_filter_mask)
+    len = sprintf(buf, "none\n");
+  else
+  {
+    len  = emuc_sysfs_print_canid(buf, priv->hw_filter_id);
+    len += sprintf(buf + len, ":%X\n", priv->hw_filter_mask & CAN_EFF_MASK);
+  }
+
+  spin_unlock_bh(&priv->info->lock);
+  return len;
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+static ssize_t filter_store (struct device *d, struct device_attribute *attr, const char *buf, size_t count)
+{
+  struct net_device  *dev  = to_net_dev(d);
+  EMUC_PRIV          *priv = netdev_priv(dev);
+  unsigned char       cmd[CMD_MAX_LEN];
+  canid_t             id = 0, mask = 0;
+  char               *p;
+  u32                 m;
+  int                 err;
+
+  if(sysfs_streq(buf, "none"))
+    EMUCFilterHex(emuc_sysfs_channel(dev), 0, 0, 0, cmd);
+  else
+  {
+    p = strnchr(buf, count, ':');
+
+    if(!p || emuc_sysfs_canid(buf, p - buf, &id) || kstrtou32(p + 1, 16, &m))
+      return -EINVAL;
+
+    mask = m & ((id & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK);
+    if(!mask)
+      return -EINVAL;
+
+    EMUCFilterHex(emuc_sysfs_channel(dev), (id & CAN_EFF_FLAG) ? EMUC_EID : EMUC_SID,
+                  id & CAN_EFF_MASK, mask, cmd);
+  }
+
+  err = emuc_cmd_sync(priv->info, cmd, CMD_MAX_LEN, NULL);
+  if(err)
+    return err;
+
+  spin_lock_bh(&priv->info->lock);
+  priv->hw_filter_id   = id & (CAN_EFF_FLAG | mask);
+  priv->hw_filter_mask = mask;
+  spin_unlock_bh(&priv->info->lock);
+
+  return count;
+}
+
+static DEVICE_ATTR_RW(filter);
+
+/*---------------------------------------------------------------------------------------------------*/
+/* queried from the device on every read */
+static ssize_t fw_version_show (struct device *d, struct device_attribute *attr, char *buf)
+{
+  EMUC_PRIV      *priv = netdev_priv(to_net_dev(d));
+  unsigned char   cmd[4], reply[CMD_VER_LEN];
+  int             err;
+
+  EMUCQueryHex(CMD_HEAD_VER, cmd);
+
+  err = emuc_cmd_sync(priv->info, cmd, sizeof(cmd), reply);
+  if(err)
+    return err;
+
+  return sprintf(buf, "%02X.%02X\n", reply[2], reply[3]);
+}
+
+static DEVICE_ATTR_RO(fw_version);
+
+#ifdef USES_CYCLIC_TX
+/*---------------------------------------------------------------------------------------------------*/
+static ssize_t cyclic_show (struct device *d, struct device_attribute *attr, char *buf)
+{
+  return emuc_cyclic_show(to_net_dev(d), buf);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+static ssize_t cyclic_store (struct device *d, struct device_attribute *attr, const char *buf, size_t count)
+{
+  int  err = emuc_cyclic_cmd(to_net_dev(d), buf, count);
+
+  return err ? err : (ssize_t) count;
+}
+
+static DEVICE_ATTR_RW(cyclic);
+#endif
+
+
+/*---------------------------------------------------------------------------------------------------*/
+static struct attribute *emuc_sysfs_attrs[] =
+{
+  &dev_attr_tx_order.attr,
+  &dev_attr_tx_mailboxes.attr,
+  &dev_attr_tx_overwrites.attr,
+  &dev_attr_tx_deadline_us.attr,
+  &dev_attr_tx_expired.attr,
+  &dev_attr_tx_stalls.attr,
+  &dev_attr_tx_resets.attr,
+  &dev_attr_gateway.attr,
+  &dev_attr_filter.attr,
+  &dev_attr_fw_version.attr,
+#ifdef USES_CYCLIC_TX
+  &dev_attr_cyclic.attr,
+#endif
+  NULL,
+};
+
+const struct attribute_group emuc_sysfs_group =
+{
+  .name  = "emuc",
+  .attrs = emuc_sysfs_attrs,
+};
@@ -2,6 +2,7 @@
 #include <linux/version.h>
 #include <linux/tty.h>
 #include <linux/mutex.h>
+#include <linux/delay.h>
 
 #include "transceive.h"
 
@@ -9,73 +10,97 @@
   #include <linux/can/skb.h>
 #endif
 
-#if _DBG_FUNC
-extern void print_func_trace (int line, const char *func);
-#endif
+#include "emuc_trace.h"
+
+/*-----------------------------------------------------------------------*/
+/* Length of the message starting with head, 0 if no message starts with it. */
+static int emuc_rx_len (unsigned char head)
+{
+  if(head == CMD_HEAD_RECV || head == CMD_HEAD_ERR)
+    return EMUC_MTU;
+
+  return EMUCReplyLen(head);
+}
 
 /*-----------------------------------------------------------------------*/
+/* A complete message is in rbuff. Returns -1 if it is not a valid one. */
+static int emuc_rx_msg (EMUC_RAW_INFO *info)
+{
+  switch(info->rbuff[0])
+  {
+    case CMD_HEAD_RECV:
+      return emuc_bump(info);
+
+    case CMD_HEAD_ERR:
+      return emuc_error(info);
+
+    default:
+      return emuc_cmd_reply(info);
+  }
+}
+
+/*-----------------------------------------------------------------------*/
+/* Collect the received bytes into messages. A message that does not check
+ * out is discarded up to its first byte and the rest is parsed again, so
+ * the stream resynchronizes after lost or corrupted bytes.
+ */
 void emuc_unesc (EMUC_RAW_INFO *info, unsigned char s)
 {
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
-#endif
+  unsigned char  pend[EMUC_MTU];
+  int            n = 1, i = 0;
 
-  if(!test_bit(SLF_ERROR, &info->flags))
+  pend[0] = s;
+
+  while(i < n)
   {
-    if(info->rcount < EMUC_MTU)
-      info->rbuff[info->rcount] = s;
-    else
+    s = pend[i++];
+
+    if(info->rcount == 0)
     {
-      info->devs[0]->stats.rx_over_errors++;
-      info->devs[1]->stats.rx_over_errors++;
-      set_bit(SLF_ERROR, &info->flags);
+      info->rlen = emuc_rx_len(s);
+
+      /* not the start of a message */
+      if(!info->rlen)
+        continue;
+
+      info->rx_start = info->rx_entry;
     }
-  }
 
-  info->rcount++;
+    info->rbuff[info->rcount++] = s;
+
+    if(info->rcount < info->rlen)
+      continue;
+
+    if(emuc_rx_msg(info) < 0)
+    {
+      trace_emuc_rx_error(info->tty, info->rbuff, info->rcount);
+      info->devs[0]->stats.rx_frame_errors++;
+      info->devs[1]->stats.rx_frame_errors++;
+
+      /* the bytes held are never more than one message */
+      memmove(pend + info->rcount - 1, pend + i, n - i);
+      memcpy(pend, info->rbuff + 1, info->rcount - 1);
+      n = info->rcount - 1 + n - i;
+      i = 0;
+    }
 
-  if(info->rcount == EMUC_MTU)
-  {
-    emuc_bump(info);
     info->rcount = 0;
   }
 }
 
 /*-----------------------------------------------------------------------*/
-void emuc_bump (EMUC_RAW_INFO *info)
+int emuc_bump (EMUC_RAW_INFO *info)
 {
   EMUC_CAN_FRAME     frame;
   int                i, ret;
   struct sk_buff    *skb;
   struct can_frame   cf;
 
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
-#endif
-
   memset(&frame, 0, sizeof(frame));
   memcpy(frame.com_buf, info->rbuff, info->rcount);
 
-  if((ret = EMUCRevHex(&frame)) < 0)
-  {
-    printk("emuc : bump : parse fail %d.\n", ret);
-    return;
-  }
-
-#if _DBG_BUMP
-/*--------------------------------------*/
-  static int cnt = 1;
-
-  printk("%d. Data: ", cnt++);
-  for(i=0; i<DATA_LEN; i++)
-    printk("%02X ", frame.data[i]);
-  printk("| ");
-  printk("ID: ");
-  for(i=0; i<ID_LEN; i++)
-    printk("%02X ", frame.id[i]);
-  printk("\n");
-/*--------------------------------------*/
-#endif
+  if((ret = EMUCRevHex(&frame)) < 0 || frame.CAN_port < EMUC_CAN_1 || frame.CAN_port > EMUC_CAN_2)
+    return -1;
 
   frame.CAN_port = frame.CAN_port + 1;
   frame.id_type  = frame.id_type - 1;
@@ -104,6 +129,14 @@ void emuc_bump (EMUC_RAW_INFO *info)
   else
     cf.can_dlc = frame.dlc;
 
+  trace_emuc_rx_frame(info->devs[frame.CAN_port - 1], &cf);
+
+  /* forward to the other channel before the local delivery */
+  emuc_gw_forward(info, frame.CAN_port - 1, &cf);
+
+  if(!netif_running(info->devs[frame.CAN_port - 1]))
+    return 0;
+
   #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,9,0)
     skb = dev_alloc_skb(sizeof(struct can_frame) + sizeof(struct can_skb_priv));
   #else
@@ -112,7 +145,7 @@ void emuc_bump (EMUC_RAW_INFO *info)
 
   if(!skb)
   {
-    return;
+    return 0;
   }
 
   skb->dev       = info->devs[frame.CAN_port - 1];
@@ -134,23 +167,143 @@ void emuc_bump (EMUC_RAW_INFO *info)
   info->devs[frame.CAN_port - 1]->stats.rx_packets++;
   info->devs[frame.CAN_port - 1]->stats.rx_bytes += cf.can_dlc;
 
+  emuc_lat_add(&((EMUC_PRIV *) netdev_priv(info->devs[frame.CAN_port - 1]))->lat[EMUC_LAT_RX],
+               info->rx_start, ktime_get());
+
   netif_rx_ni(skb);
+  return 0;
 
 } /* END: emuc_bump() */
 
 /*-----------------------------------------------------------------------*/
+/* Bus error report of one channel: counters, state changes, overflows. */
+#ifdef USES_ALLOC_CANDEV
+static void emuc_error_channel (EMUC_RAW_INFO *info, int channel, const unsigned char *err)
+{
+  struct net_device  *dev  = info->devs[channel];
+  EMUC_PRIV          *priv = netdev_priv(dev);
+  enum can_state      state, old, tx_state, rx_state;
+  struct sk_buff     *skb;
+  struct can_frame   *cf;
+
+  if(!netif_running(dev))
+    return;
+
+  if(err[ERR_FLAGS] & ERR_FLAG_BUSOFF)
+    state = CAN_STATE_BUS_OFF;
+  else if(err[ERR_FLAGS] & ERR_FLAG_PASSIVE)
+    state = CAN_STATE_ERROR_PASSIVE;
+  else if(err[ERR_FLAGS] & ERR_FLAG_WARNING)
+    state = CAN_STATE_ERROR_WARNING;
+  else
+    state = CAN_STATE_ERROR_ACTIVE;
+
+  spin_lock_bh(&info->lock);
+  priv->bec.txerr = err[ERR_TEC];
+  priv->bec.rxerr = err[ERR_REC];
+  old = priv->can.state;
+  spin_unlock_bh(&info->lock);
+
+  if(state == old && !(err[ERR_FLAGS] & ERR_FLAG_OVERFLOW))
+    return;
+
+  /* a failed allocation still changes the state */
+  skb = alloc_can_err_skb(dev, &cf);
+
+  if(err[ERR_FLAGS] & ERR_FLAG_OVERFLOW)
+  {
+    dev->stats.rx_over_errors++;
+    dev->stats.rx_errors++;
+
+    if(skb)
+    {
+      cf->can_id  |= CAN_ERR_CRTL;
+      cf->data[1] |= CAN_ERR_CRTL_RX_OVERFLOW;
+    }
+  }
+
+  if(state != old)
+  {
+    tx_state = err[ERR_TEC] >= err[ERR_REC] ? state : CAN_STATE_ERROR_ACTIVE;
+    rx_state = err[ERR_TEC] <= err[ERR_REC] ? state : CAN_STATE_ERROR_ACTIVE;
+    can_change_state(dev, skb ? cf : NULL, tx_state, rx_state);
+
+    if(state == CAN_STATE_BUS_OFF)
+    {
+      /* frames waiting for a dead controller fail now, not after the restart */
+      spin_lock_bh(&info->lock);
+      trace_emuc_queue_stop(dev, 0);
+      netif_tx_stop_all_queues(dev);
+      emuc_tx_purge(info, channel);
+      spin_unlock_bh(&info->lock);
+
+      can_bus_off(dev);
+    }
+    else if(old == CAN_STATE_BUS_OFF && !priv->can.restart_ms)
+    {
+      /* The controller recovered on its own. With restart-ms the can core
+       * has a restart scheduled, which must find the carrier off; it calls
+       * emuc_set_mode() and turns the carrier on itself.
+       */
+      netif_carrier_on(dev);
+      trace_emuc_queue_wake(dev, 0);
+      netif_tx_wake_all_queues(dev);
+
+    #ifdef USES_CYCLIC_TX
+      emuc_cyclic_start(dev);
+    #endif
+    }
+  }
+
+  if(!skb)
+    return;
+
+  if(state != CAN_STATE_BUS_OFF)
+  {
+    cf->data[6] = err[ERR_TEC];
+    cf->data[7] = err[ERR_REC];
+  }
+
+  dev->stats.rx_packets++;
+  dev->stats.rx_bytes += cf->can_dlc;
+  netif_rx_ni(skb);
+}
+#endif
+
+/*-----------------------------------------------------------------------*/
+/* CMD_HEAD_ERR report in rbuff. Returns -1 if it is not a valid one. */
+int emuc_error (EMUC_RAW_INFO *info)
+{
+  unsigned char  err[2][ERR_DATA_LEN];
+  int            type = EMUCErrHex(info->rbuff, err);
+
+  switch(type)
+  {
+    case ERR_TYPE_EEPROM:
+      printk(KERN_ERR "emuc: %s: device reports an EEPROM error\n", info->tty ? info->tty->name : "?");
+      return 0;
+
+    case ERR_TYPE_BUS:
+    #ifdef USES_ALLOC_CANDEV
+      emuc_error_channel(info, EMUC_CAN_1, err[EMUC_CAN_1]);
+      emuc_error_channel(info, EMUC_CAN_2, err[EMUC_CAN_2]);
+    #endif
+      return 0;
+
+    default:
+      return -1;
+  }
+}
+
+/*-----------------------------------------------------------------------*/
+/* Append the encoded frame to xbuff, the caller writes it to the tty. */
 void emuc_encaps (EMUC_RAW_INFO *info, int channel, struct can_frame *cf)
 {
   int             i;
   int             len = COM_BUF_LEN;
-  int             actual;
   canid_t         id = cf->can_id;
   EMUC_CAN_FRAME  emuc_can_frame;
 
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
-#endif
-
   memset(&emuc_can_frame, 0, sizeof(EMUC_CAN_FRAME));
   emuc_can_frame.CAN_port = channel;
   emuc_can_frame.rtr = (cf->can_id & CAN_RTR_FLAG) ? 1: 0;
@@ -178,8 +331,317 @@ void emuc_encaps (EMUC_RAW_INFO *info, int channel, struct can_frame *cf)
     emuc_can_frame.data[i] = cf->data[i];
 
   EMUCSendHex(&emuc_can_frame);
-  memcpy(info->xbuff, emuc_can_frame.com_buf, len);
+  trace_emuc_tx_encaps(info->devs[channel], cf);
+  memcpy(info->xhead + info->xleft, emuc_can_frame.com_buf, len);
+  info->xleft += len;
+
+} /* END: emuc_encaps() */
+
+/*-----------------------------------------------------------------------*/
+/* Write the rest of xbuff to the tty and complete every frame whose last
+ * byte has been accepted. Called with info->lock held.
+ */
+static void emuc_tx_write (EMUC_RAW_INFO *info)
+{
+  int  actual;
+
+  actual = info->tty->ops->write(info->tty, info->xhead, info->xleft);
+
+  if(actual < info->xleft)
+    trace_emuc_tx_partial(info->tty, info->xleft, actual);
+
+  info->xleft -= actual;
+  info->xhead += actual;
+
+  if(actual > 0)
+    info->tx_progress = jiffies;
+
+  while(!skb_queue_empty(&info->xq) &&
+        info->xhead - info->xbuff - info->xcmd >= (info->xdone + 1) * COM_BUF_LEN)
+  {
+    info->xdone++;
+    emuc_tx_done(info);
+  }
+
+  if(info->xleft > 0)
+    emuc_watchdog_arm(info);
+}
+
+/*-----------------------------------------------------------------------*/
+void emuc_transmit (struct work_struct *work)
+{
+  EMUC_RAW_INFO  *info = container_of(work, EMUC_RAW_INFO, tx_work);
+
+  spin_lock_bh(&info->lock);
+
+  /* First make sure we're connected. Commands still go out when both
+   * interfaces are down, the queues are empty then.
+   */
+  if(!info->tty || info->magic != EMUC_MAGIC)
+  {
+    spin_unlock_bh(&info->lock);
+    return;
+  }
+
+  trace_emuc_tx_work(info->tty, info->xleft);
+
+  if(info->xleft <= 0)
+  {
+    /* previous frames are out: continue with the next pending ones */
+    if(!emuc_tx_next(info))
+      clear_bit(TTY_DO_WRITE_WAKEUP, &info->tty->flags);
+
+    spin_unlock_bh(&info->lock);
+    return;
+  }
+
+  emuc_tx_write(info);
+  spin_unlock_bh(&info->lock);
+}
+
+/*-----------------------------------------------------------------------*/
+/* CAN arbitration order of a frame, lower key wins on the bus. The bits
+ * follow the arbitration field: base id, RTR (SRR), IDE, extended id and
+ * RTR of extended frames.
+ */
+static u32 emuc_tx_prio (const struct can_frame *cf)
+{
+  u32  id  = cf->can_id;
+  u32  rtr = (id & CAN_RTR_FLAG) ? 1 : 0;
+
+  if(id & CAN_EFF_FLAG)
+  {
+    id &= CAN_EFF_MASK;
+    return ((id >> 18) << 21) | (1 << 20) | (1 << 19) | ((id & 0x3FFFF) << 1) | rtr;
+  }
+
+  return ((id & CAN_SFF_MASK) << 21) | (rtr << 20);
+}
 
+/*-----------------------------------------------------------------------*/
+/* Does pending frame a go out before frame b of the same channel? Lower
+ * netdev queues (mqprio traffic classes) always win, within a queue the
+ * channel's tx_order decides. Equal frames keep their order of arrival.
+ */
+static int emuc_tx_before (EMUC_PRIV *priv, struct sk_buff *a, struct sk_buff *b)
+{
+  if(a->queue_mapping != b->queue_mapping)
+    return a->queue_mapping < b->queue_mapping;
+
+  if(priv->tx_order == EMUC_TX_CANID && emuc_skb_cb(a)->prio != emuc_skb_cb(b)->prio)
+    return emuc_skb_cb(a)->prio < emuc_skb_cb(b)->prio;
+
+  return (s32) (emuc_skb_cb(a)->seq - emuc_skb_cb(b)->seq) < 0;
+}
+
+/*-----------------------------------------------------------------------*/
+static void emuc_tx_insert (EMUC_PRIV *priv, struct sk_buff *skb)
+{
+  struct sk_buff  *pos;
+
+  /* insertion from the tail: O(1) for FIFO order */
+  skb_queue_reverse_walk(&priv->txq, pos)
+  {
+    if(!emuc_tx_before(priv, skb, pos))
+      break;
+  }
+
+  __skb_queue_after(&priv->txq, pos, skb);
+}
+
+/*-----------------------------------------------------------------------*/
+/* Latest-value mailbox: if the id of the frame is configured as mailbox
+ * and a frame with that id is still pending, the new frame takes its
+ * place in the queue and the old one is dropped. Returns 1 if replaced.
+ */
+static int emuc_tx_mailbox (EMUC_PRIV *priv, struct sk_buff *skb)
+{
+  canid_t          id = ((struct can_frame *) skb->data)->can_id & (CAN_EFF_FLAG | CAN_EFF_MASK);
+  struct sk_buff  *pos;
+  int              i;
+
+  for(i=0; i<priv->tx_mbox_cnt; i++)
+  {
+    if(priv->tx_mbox[i] == id)
+      break;
+  }
+
+  if(i == priv->tx_mbox_cnt)
+    return 0;
+
+  skb_queue_walk(&priv->txq, pos)
+  {
+    if((((struct can_frame *) pos->data)->can_id & (CAN_EFF_FLAG | CAN_EFF_MASK)) != id)
+      continue;
+
+    /* keep the position of the old frame, also in FIFO order */
+    emuc_skb_cb(skb)->seq = emuc_skb_cb(pos)->seq;
+    __skb_queue_after(&priv->txq, pos, skb);
+    __skb_unlink(pos, &priv->txq);
+
+    priv->tx_overwrites++;
+    pos->dev->stats.tx_dropped++;
+    kfree_skb(pos);
+    return 1;
+  }
+
+  return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Queue a frame of a channel for transmission. Stops the netdev queues
+ * when the channel holds EMUC_TX_PENDING frames. Called with info->lock held.
+ */
+void emuc_tx_enqueue (EMUC_RAW_INFO *info, int channel, struct sk_buff *skb)
+{
+  struct net_device  *dev  = info->devs[channel];
+  EMUC_PRIV          *priv = netdev_priv(dev);
+
+  emuc_skb_cb(skb)->prio = emuc_tx_prio((struct can_frame *) skb->data);
+  emuc_skb_cb(skb)->seq  = info->tx_seq++;
+  emuc_skb_cb(skb)->enqueued = ktime_get();
+
+  if(emuc_tx_mailbox(priv, skb))
+    return;
+
+  emuc_tx_insert(priv, skb);
+
+  if(skb_queue_len(&priv->txq) >= EMUC_TX_PENDING)
+  {
+    trace_emuc_queue_stop(dev, skb_queue_len(&priv->txq));
+    netif_tx_stop_all_queues(dev);
+  }
+}
+
+/*-----------------------------------------------------------------------*/
+/* Sort the pending frames of a channel again after its tx_order changed.
+ * Called with info->lock held.
+ */
+void emuc_tx_reorder (EMUC_RAW_INFO *info, int channel)
+{
+  EMUC_PRIV            *priv = netdev_priv(info->devs[channel]);
+  struct sk_buff_head   list;
+  struct sk_buff       *skb;
+
+  __skb_queue_head_init(&list);
+  skb_queue_splice_init(&priv->txq, &list);
+
+  while((skb = __skb_dequeue(&list)) != NULL)
+    emuc_tx_insert(priv, skb);
+}
+
+/*-----------------------------------------------------------------------*/
+/* Channel to send from next: the older head frame, or the head with the
+ * higher bus priority when both channels are in EMUC_TX_CANID order.
+ */
+static int emuc_tx_pick (EMUC_RAW_INFO *info)
+{
+  EMUC_PRIV       *priv[2];
+  struct sk_buff  *head[2];
+  int              i;
+
+  for(i=0; i<2; i++)
+  {
+    priv[i] = netdev_priv(info->devs[i]);
+    head[i] = skb_peek(&priv[i]->txq);
+  }
+
+  if(!head[0])
+    return head[1] ? 1 : -1;
+
+  if(!head[1])
+    return 0;
+
+  if(priv[0]->tx_order == EMUC_TX_CANID && priv[1]->tx_order == EMUC_TX_CANID &&
+     emuc_skb_cb(head[0])->prio != emuc_skb_cb(head[1])->prio)
+    return emuc_skb_cb(head[1])->prio < emuc_skb_cb(head[0])->prio;
+
+  return (s32) (emuc_skb_cb(head[1])->seq - emuc_skb_cb(head[0])->seq) < 0;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Dequeue the next frame to send from both channels. Frames that waited
+ * longer than the tx_deadline of their channel are dropped instead of
+ * going late onto the bus. Returns NULL if nothing is pending.
+ */
+static struct sk_buff *emuc_tx_dequeue (EMUC_RAW_INFO *info, ktime_t now, int *channel)
+{
+  struct net_device  *dev;
+  struct sk_buff     *skb;
+  EMUC_PRIV          *priv;
+
+  for(;;)
+  {
+    *channel = emuc_tx_pick(info);
+
+    if(*channel < 0)
+      return NULL;
+
+    dev  = info->devs[*channel];
+    priv = netdev_priv(dev);
+    skb  = __skb_dequeue(&priv->txq);
+
+    if(skb_queue_len(&priv->txq) < EMUC_TX_PENDING && netif_running(dev) &&
+       netif_tx_queue_stopped(netdev_get_tx_queue(dev, 0)))
+    {
+      trace_emuc_queue_wake(dev, skb_queue_len(&priv->txq));
+      netif_tx_wake_all_queues(dev);
+    }
+
+    if(!priv->tx_deadline ||
+       ktime_us_delta(now, emuc_skb_cb(skb)->enqueued) <= priv->tx_deadline)
+      return skb;
+
+    priv->tx_expired++;
+    dev->stats.tx_dropped++;
+    kfree_skb(skb);
+  }
+}
+
+/*-----------------------------------------------------------------------*/
+/* Start writing the next pending frames to the tty. As many frames as
+ * the tty has room for, up to EMUC_TX_BATCH, are gathered from both
+ * channels into xbuff and handed over in one write, so a USB serial
+ * link carries them in one transfer. In the low latency profile batches
+ * are short, so a new frame waits behind few others. Queued device
+ * commands go first.
+ * A non-zero xmit_delay paces every frame and disables gathering.
+ * Returns 0 if nothing is pending.
+ * Called with info->lock held and xbuff idle.
+ */
+int emuc_tx_next (EMUC_RAW_INFO *info)
+{
+  int              channel;
+  int              n, max;
+  struct sk_buff  *skb;
+  ktime_t          now = ktime_get();
+
+  max = test_bit(SLF_LOW_LATENCY, &info->flags) ? EMUC_TX_LL_BATCH : EMUC_TX_BATCH;
+  max = info->xmit_delay ? 1 : clamp_t(int, tty_write_room(info->tty) / COM_BUF_LEN, 1, max);
+
+  memcpy(info->xbuff, info->cbuff, info->ccount);
+  info->xhead  = info->xbuff;
+  info->xleft  = info->ccount;
+  info->xcmd   = info->ccount;
+  info->xdone  = 0;
+  info->ccount = 0;
+
+  for(n=0; n<max; n++)
+  {
+    skb = emuc_tx_dequeue(info, now, &channel);
+
+    if(!skb)
+      break;
+
+    emuc_encaps(info, channel, (struct can_frame *) skb->data);
+    __skb_queue_tail(&info->xq, skb);
+  }
+
+  if(!info->xleft)
+    return 0;
+
+  if(n && info->xmit_delay)
+    udelay(info->xmit_delay);
 
   /* Order of next two lines is *very* important.
    * When we are sending a little amount of data,
@@ -189,79 +651,367 @@ void emuc_encaps (EMUC_RAW_INFO *info, int channel, struct can_frame *cf)
    * if we did not request it before write operation.
    *       14 Oct 1994  Dmitry Gorodchanin.
    */
-
   set_bit(TTY_DO_WRITE_WAKEUP, &info->tty->flags);
-  actual = info->tty->ops->write(info->tty, info->xbuff, len);
+  info->tx_progress = jiffies;
+
+  /* every frame in xq is new, xbuff was idle */
+  now = ktime_get();
+  skb_queue_walk(&info->xq, skb)
+    emuc_lat_add(&((EMUC_PRIV *) netdev_priv(skb->dev))->lat[EMUC_LAT_TX_WRITE], emuc_skb_cb(skb)->xmit, now);
+
+  emuc_tx_write(info);
+  return 1;
+}
 
-  info->xleft = len - actual;
-  info->xhead = info->xbuff + actual;
-  info->devs[channel]->stats.tx_bytes += cf->can_dlc;
+/*-----------------------------------------------------------------------*/
+/* The last byte of the first frame in xbuff has been accepted by the tty:
+ * account it on the channel it was sent from and release the echo.
+ * Called with info->lock held.
+ */
+void emuc_tx_done (EMUC_RAW_INFO *info)
+{
+  struct sk_buff     *skb = __skb_dequeue(&info->xq);
+  struct net_device  *dev;
+  struct can_frame   *cf;
 
+  if(!skb)
+    return;
 
-  /* v2.2: for fixing tx_packet bug */
-  info->current_channel = channel;
+  dev = skb->dev;
+  cf  = (struct can_frame *) skb->data;
 
-} /* END: emuc_encaps() */
+  dev->stats.tx_packets++;
+  dev->stats.tx_bytes += cf->can_dlc;
+
+  emuc_lat_add(&((EMUC_PRIV *) netdev_priv(dev))->lat[EMUC_LAT_TX_DONE], emuc_skb_cb(skb)->xmit, ktime_get());
+
+  /* SOF_TIMESTAMPING_TX_SOFTWARE: last byte handed to the tty */
+  if(skb_shinfo(skb)->tx_flags & SKBTX_SW_TSTAMP)
+    skb_tstamp_tx(skb, NULL);
+
+  #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,12,0)
+    can_put_echo_skb(skb, dev, 0, 0);
+    can_get_echo_skb(dev, 0, NULL);
+  #elif defined(USES_ALLOC_CANDEV)
+    can_put_echo_skb(skb, dev, 0);
+    can_get_echo_skb(dev, 0);
+  #else
+    kfree_skb(skb);
+  #endif
+}
 
 /*-----------------------------------------------------------------------*/
-void emuc_transmit (struct work_struct *work)
+/* Drop the frames in xbuff without echo, e.g. when the interfaces go down
+ * before they were completely written. Called with info->lock held.
+ */
+void emuc_tx_abort (EMUC_RAW_INFO *info)
 {
-  int             actual;
-  EMUC_RAW_INFO  *info = container_of(work, EMUC_RAW_INFO, tx_work);
+  struct sk_buff  *skb;
 
-#if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
-#endif
+  while((skb = __skb_dequeue(&info->xq)) != NULL)
+  {
+    skb->dev->stats.tx_dropped++;
+    kfree_skb(skb);
+  }
+}
 
-  spin_lock_bh(&info->lock);
+/*-----------------------------------------------------------------------*/
+/* Drop the pending frames of a channel. Called with info->lock held. */
+void emuc_tx_purge (EMUC_RAW_INFO *info, int channel)
+{
+  struct net_device  *dev  = info->devs[channel];
+  EMUC_PRIV          *priv = netdev_priv(dev);
+
+  dev->stats.tx_dropped += skb_queue_len(&priv->txq);
+  __skb_queue_purge(&priv->txq);
+}
 
-  /* First make sure we're connected. */
-  if(!info->tty || info->magic != EMUC_MAGIC || (!netif_running(info->devs[0]) && !netif_running(info->devs[1])))
+/*-----------------------------------------------------------------------*/
+/* Retire the waiting command at index i. Called with info->lock held. */
+static void emuc_cmd_done (EMUC_RAW_INFO *info, int i, const unsigned char *reply, int status)
+{
+  EMUC_CMD_WAIT  *w = &info->cwait[i];
+
+  if(w->req)
   {
-    spin_unlock_bh(&info->lock);
-    return;
+    if(reply)
+      memcpy(w->req->reply, reply, EMUCReplyLen(w->head));
+
+    w->req->status = status;
+    complete(&w->req->done);
   }
+  else if(status == -ETIMEDOUT)
+    printk(KERN_WARNING "emuc: no reply to command 0x%02X\n", w->head);
+  else if(status > 0)
+    printk(KERN_ERR "emuc: command 0x%02X failed, status %d\n", w->head, status);
 
-  if(info->xleft <= 0)
+  info->cwait_cnt--;
+  memmove(w, w + 1, (info->cwait_cnt - i) * sizeof(*w));
+}
+
+/*-----------------------------------------------------------------------*/
+/* Retire the commands whose reply is overdue. Called with info->lock held. */
+static void emuc_cmd_expire (EMUC_RAW_INFO *info)
+{
+  int  i = 0;
+
+  while(i < info->cwait_cnt)
   {
-    info->devs[info->current_channel]->stats.tx_packets++;
-    clear_bit(TTY_DO_WRITE_WAKEUP, &info->tty->flags);
-    spin_unlock_bh(&info->lock);
-    
-    if (netif_running(info->devs[0]))
-      netif_wake_queue(info->devs[0]);
-    if (netif_running(info->devs[1]))
-      netif_wake_queue(info->devs[1]);
-    return;
+    if(time_after(jiffies, info->cwait[i].expires))
+      emuc_cmd_done(info, i, NULL, -ETIMEDOUT);
+    else
+      i++;
   }
+}
 
-  actual = info->tty->ops->write(info->tty, info->xhead, info->xleft);
-  info->xleft -= actual;
-  info->xhead += actual;
+/*-----------------------------------------------------------------------*/
+/* Queue a command for the device. It is written ahead of the next frames,
+ * so it never splits a frame in xbuff. Its reply is expected within
+ * EMUC_CMD_TIMEOUT and handed to req, or only logged if req is NULL.
+ * Called with info->lock held.
+ */
+int emuc_cmd_queue (EMUC_RAW_INFO *info, const unsigned char *cmd, int len, EMUC_CMD_REQ *req)
+{
+  EMUC_CMD_WAIT  *w;
+  int             wait = EMUCReplyLen(cmd[0]) > 0;
+
+  emuc_cmd_expire(info);
+
+  if(info->ccount + len > EMUC_CMD_BUF || (wait && info->cwait_cnt == EMUC_CMD_PENDING))
+  {
+    printk(KERN_WARNING "emuc: command 0x%02X dropped, queue full\n", cmd[0]);
+    return -EBUSY;
+  }
+
+  if(wait)
+  {
+    w = &info->cwait[info->cwait_cnt++];
+    w->head    = cmd[0];
+    w->expires = jiffies + EMUC_CMD_TIMEOUT;
+    w->req     = req;
+  }
+
+  memcpy(info->cbuff + info->ccount, cmd, len);
+  info->ccount += len;
+
+  if(info->tty && info->xleft <= 0)
+    emuc_tx_next(info);
+
+  return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Send a command and wait for its reply, which is copied to reply (up to
+ * CMD_VER_LEN bytes) unless it is NULL. Returns 0, -EIO if the device
+ * refused the command, -ETIMEDOUT or -ENODEV.
+ * Process context, info->lock not held.
+ */
+int emuc_cmd_sync (EMUC_RAW_INFO *info, const unsigned char *cmd, int len, unsigned char *reply)
+{
+  EMUC_CMD_REQ  req;
+  int           i, err;
+
+  init_completion(&req.done);
+  req.status = -ETIMEDOUT;
+
+  spin_lock_bh(&info->lock);
+  err = info->tty ? emuc_cmd_queue(info, cmd, len, &req) : -ENODEV;
   spin_unlock_bh(&info->lock);
+
+  if(err)
+    return err;
+
+  if(!wait_for_completion_timeout(&req.done, EMUC_CMD_TIMEOUT + 1))
+  {
+    /* req lives on this stack, it must not stay in cwait */
+    spin_lock_bh(&info->lock);
+
+    for(i=0; i<info->cwait_cnt; i++)
+    {
+      if(info->cwait[i].req == &req)
+      {
+        emuc_cmd_done(info, i, NULL, -ETIMEDOUT);
+        break;
+      }
+    }
+
+    spin_unlock_bh(&info->lock);
+  }
+
+  if(req.status == 0 && reply)
+    memcpy(reply, req.reply, CMD_VER_LEN);
+
+  return req.status > 0 ? -EIO : req.status;
 }
 
 /*-----------------------------------------------------------------------*/
-void emuc_initCAN (EMUC_RAW_INFO *info, int sts)
+/* The tty is gone: fail everything still waiting. Called with info->lock held. */
+void emuc_cmd_flush (EMUC_RAW_INFO *info)
+{
+  while(info->cwait_cnt)
+    emuc_cmd_done(info, 0, NULL, -ENODEV);
+
+  info->ccount = 0;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Set the active state of both channels. Called with info->lock held. */
+void emuc_initCAN (EMUC_RAW_INFO *info, int sts1, int sts2)
 {
   int len = 6;
-  int actual;
   unsigned char cmd[6] = {CMD_HEAD_INIT, 0x00, 0x00, 0x00, 0x0D, 0x0A};
 
-  #if _DBG_FUNC
-  print_func_trace(__LINE__, __FUNCTION__);
-  #endif
-  
-  EMUCInitHex(sts, cmd);
-
-#if 0
-/*--------------------------------------*/
-  for(i=0; i<len; i++)
-    printk("%02X ", *(cmd + i));
-  printk("\n");
-/*--------------------------------------*/
+  EMUCInitHex(sts1, sts2, cmd);
+  emuc_cmd_queue(info, cmd, len, NULL);
+}
+
+/*-----------------------------------------------------------------------*/
+/* Send the bitrate codes in info->baud and wait for the device. */
+int emuc_baud (EMUC_RAW_INFO *info)
+{
+  unsigned char cmd[6];
+
+  spin_lock_bh(&info->lock);
+  EMUCBaudHex(info->baud[0], info->baud[1], cmd);
+  spin_unlock_bh(&info->lock);
+
+  return emuc_cmd_sync(info, cmd, sizeof(cmd), NULL);
+}
+
+/*-----------------------------------------------------------------------*/
+/* Set the mode of one channel, the command carries the other one's as it
+ * is. Queued like emuc_initCAN(), the reply is only logged.
+ * Called with info->lock held.
+ */
+int emuc_mode (EMUC_RAW_INFO *info, int channel, int mode)
+{
+  unsigned char  cmd[6];
+  int            m[2], err;
+
+  if(info->mode[channel] == mode)
+    return 0;
+
+  m[channel]  = mode;
+  m[!channel] = info->mode[!channel] < 0 ? EMUC_NORMAL : info->mode[!channel];
+  EMUCModeHex(m[0], m[1], cmd);
+
+  err = emuc_cmd_queue(info, cmd, sizeof(cmd), NULL);
+
+  if(!err)
+  {
+    info->mode[0] = m[0];
+    info->mode[1] = m[1];
+  }
+
+  return err;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Select the error reports the device sends, CMD_HEAD_ERRTYPE. Queued like
+ * emuc_initCAN(), the reply is only logged. Called with info->lock held.
+ */
+int emuc_err_type (EMUC_RAW_INFO *info, int type)
+{
+  unsigned char  cmd[5];
+  int            err;
+
+  if(info->err_type == type)
+    return 0;
+
+  EMUCErrTypeHex(type, cmd);
+  err = emuc_cmd_queue(info, cmd, sizeof(cmd), NULL);
+
+  if(!err)
+    info->err_type = type;
+
+  return err;
+}
+
+/*-----------------------------------------------------------------------*/
+/* A replugged adapter starts from its defaults: queue the bitrate, filters
+ * and modes the channels had before, then activate the running ones. The
+ * ldisc is being opened, so the replies are only logged.
+ * Called with info->lock held.
+ */
+void emuc_restore (EMUC_RAW_INFO *info)
+{
+  unsigned char  cmd[CMD_MAX_LEN];
+  EMUC_PRIV     *priv;
+  int            i;
+#ifdef USES_ALLOC_CANDEV
+  int            running = 0;
 #endif
 
-  set_bit(TTY_DO_WRITE_WAKEUP, &info->tty->flags);
-  actual = info->tty->ops->write(info->tty, cmd, len);
-}
\ No newline at end of file
+  if(info->baud[0] && info->baud[1])
+  {
+    EMUCBaudHex(info->baud[0], info->baud[1], cmd);
+    emuc_cmd_queue(info, cmd, 6, NULL);
+  }
+
+  for(i=0; i<2; i++)
+  {
+    priv = netdev_priv(info->devs[i]);
+
+    if(priv->hw_filter_mask)
+    {
+      EMUCFilterHex(i, (priv->hw_filter_id & CAN_EFF_FLAG) ? EMUC_EID : EMUC_SID,
+                    priv->hw_filter_id & CAN_EFF_MASK, priv->hw_filter_mask, cmd);
+      emuc_cmd_queue(info, cmd, CMD_MAX_LEN, NULL);
+    }
+
+    info->mode[i] = emuc_listen_only(info->devs[i]) ? EMUC_LISTEN : EMUC_NORMAL;
+
+#ifdef USES_ALLOC_CANDEV
+    if(netif_running(info->devs[i]))
+      running = 1;
+#endif
+  }
+
+  EMUCModeHex(info->mode[0], info->mode[1], cmd);
+  emuc_cmd_queue(info, cmd, 6, NULL);
+
+#ifdef USES_ALLOC_CANDEV
+  if(running)
+  {
+    info->err_type = EMUC_EN_ALL;
+    EMUCErrTypeHex(EMUC_EN_ALL, cmd);
+    emuc_cmd_queue(info, cmd, 5, NULL);
+  }
+#endif
+
+  emuc_initCAN(info, netif_running(info->devs[0]) ? EMUC_ACTIVE : EMUC_INACTIVE,
+                     netif_running(info->devs[1]) ? EMUC_ACTIVE : EMUC_INACTIVE);
+}
+
+/*-----------------------------------------------------------------------*/
+/* A command reply is in rbuff, hand it to the oldest command waiting for
+ * one with its head. Returns -1 if rbuff does not hold a valid reply.
+ */
+int emuc_cmd_reply (EMUC_RAW_INFO *info)
+{
+  const unsigned char  *cp = info->rbuff;
+  int                   status = EMUCReplyHex(cp, info->rcount);
+  int                   i;
+
+  if(status < 0)
+    return -1;
+
+  if(cp[0] == CMD_HEAD_INIT && status == 0)
+    printk(KERN_INFO "emuc: Device set \"active\" successfully.\n");
+
+  spin_lock_bh(&info->lock);
+
+  emuc_cmd_expire(info);
+
+  for(i=0; i<info->cwait_cnt; i++)
+  {
+    if(info->cwait[i].head == cp[0])
+    {
+      emuc_cmd_done(info, i, cp, status);
+      break;
+    }
+  }
+
+  spin_unlock_bh(&info->lock);
+  return 0;
+}
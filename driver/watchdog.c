@@ -0,0 +1,185 @@
+#include <linux/version.h>
+#include <linux/module.h>
+#include <linux/netdevice.h>
+#include <linux/tty.h>
+#include <linux/timer.h>
+#include <linux/jiffies.h>
+#include <linux/kobject.h>
+
+#include "transceive.h"
+#include "emuc_trace.h"
+
+/* Transmit stall watchdog: while bytes are left in xbuff, the tty has to
+ * take some of them every tx_stall_ms. If it did not, the write is first
+ * retried as if the write wakeup had been lost. If that does not help
+ * either, the tty's buffer is flushed, the frames in xbuff are dropped and
+ * counted in tx_dropped, and transmission goes on with the next pending
+ * ones. A frame the device already got the start of arrives truncated.
+ * Both steps are counted and reported as uevent.
+ */
+
+static unsigned int tx_stall_ms = 1000;
+module_param(tx_stall_ms, uint, 0644);
+MODULE_PARM_DESC(tx_stall_ms, "Time in ms without transmit progress before the driver retries and then resets the transmission, 0: off");
+
+/*---------------------------------------------------------------------------------------------------*/
+/* A channel is woken after a reset unless it is down, bus-off or full. */
+static void emuc_watchdog_wake (EMUC_RAW_INFO *info)
+{
+  struct net_device  *dev;
+  int                 i;
+
+  for(i=0; i<2; i++)
+  {
+    dev = info->devs[i];
+
+    if(netif_running(dev) && !emuc_bus_off(dev) &&
+       skb_queue_len(&((EMUC_PRIV *) netdev_priv(dev))->txq) < EMUC_TX_PENDING)
+    {
+      trace_emuc_queue_wake(dev, skb_queue_len(&((EMUC_PRIV *) netdev_priv(dev))->txq));
+      netif_tx_wake_all_queues(dev);
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0)
+static void emuc_watchdog (struct timer_list *t)
+{
+  EMUC_RAW_INFO  *info = from_timer(info, t, tx_watchdog);
+#else
+static void emuc_watchdog (unsigned long data)
+{
+  EMUC_RAW_INFO  *info = (EMUC_RAW_INFO *) data;
+#endif
+  unsigned long   stall = msecs_to_jiffies(tx_stall_ms);
+
+  /* softirq context, like emuc_xmit() */
+  spin_lock(&info->lock);
+
+  /* the reset is pending in emuc_watchdog_event() */
+  if(info->tx_stall_stage == 2)
+  {
+    spin_unlock(&info->lock);
+    return;
+  }
+
+  if(!info->tty || info->xleft <= 0 || !tx_stall_ms)
+  {
+    info->tx_stall_stage = 0;
+    spin_unlock(&info->lock);
+    return;
+  }
+
+  if(time_before(jiffies, info->tx_progress + stall))
+  {
+    /* the tty took bytes since the timer was set */
+    info->tx_stall_stage = 0;
+    mod_timer(&info->tx_watchdog, info->tx_progress + stall);
+    spin_unlock(&info->lock);
+    return;
+  }
+
+  info->tx_stalls++;
+
+  if(!info->tx_stall_stage)
+  {
+    printk(KERN_WARNING "emuc: %s: transmit stalled with %d bytes left, retrying\n", info->tty->name, info->xleft);
+
+    info->tx_stall_stage = 1;
+    info->tx_stall_event = 1;
+    info->tx_progress = jiffies;
+    set_bit(TTY_DO_WRITE_WAKEUP, &info->tty->flags);
+    emuc_tx_schedule(info);
+    mod_timer(&info->tx_watchdog, jiffies + stall);
+  }
+  else
+  {
+    /* flushing the tty may sleep */
+    info->tx_stall_stage = 2;
+  }
+
+  schedule_work(&info->tx_stall_work);
+  spin_unlock(&info->lock);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+/* Drop xbuff after the tty's buffer was flushed. Called with info->lock held. */
+static void emuc_watchdog_reset (EMUC_RAW_INFO *info)
+{
+  printk(KERN_WARNING "emuc: %s: transmit still stalled, dropping %d bytes\n", info->tty->name, info->xleft);
+
+  /* the next batch gets a full period and a retry first */
+  info->tx_stall_stage = 0;
+  info->tx_stall_event = 2;
+  info->tx_resets++;
+  info->tx_progress = jiffies;
+  info->xleft = 0;
+  emuc_tx_abort(info);
+  emuc_watchdog_wake(info);
+
+  if(!emuc_tx_next(info))
+    clear_bit(TTY_DO_WRITE_WAKEUP, &info->tty->flags);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+/* KOBJ_CHANGE on both interfaces, e.g. for udev rules or emucd -c:
+ * EMUC_TX_STALL=retry|reset, EMUC_TX_STALLS=<n>, EMUC_TX_RESETS=<n>
+ */
+static void emuc_watchdog_event (struct work_struct *work)
+{
+  EMUC_RAW_INFO     *info = container_of(work, EMUC_RAW_INFO, tx_stall_work);
+  struct tty_struct *tty;
+  char               stall[24], stalls[32], resets[32];
+  char              *envp[] = { stall, stalls, resets, NULL };
+  int                i;
+
+  /* a reset first drops what the tty holds of xbuff, emuc_watchdog_stop() waits for this */
+  spin_lock_bh(&info->lock);
+  tty = info->tx_stall_stage == 2 ? info->tty : NULL;
+  spin_unlock_bh(&info->lock);
+
+  if(tty)
+    tty_driver_flush_buffer(tty);
+
+  spin_lock_bh(&info->lock);
+
+  if(tty && info->tty == tty)
+    emuc_watchdog_reset(info);
+
+  snprintf(stall,  sizeof(stall),  "EMUC_TX_STALL=%s", info->tx_stall_event == 2 ? "reset" : "retry");
+  snprintf(stalls, sizeof(stalls), "EMUC_TX_STALLS=%lu", info->tx_stalls);
+  snprintf(resets, sizeof(resets), "EMUC_TX_RESETS=%lu", info->tx_resets);
+  spin_unlock_bh(&info->lock);
+
+  for(i=0; i<2; i++)
+    kobject_uevent_env(&info->devs[i]->dev.kobj, KOBJ_CHANGE, envp);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+void emuc_watchdog_init (EMUC_RAW_INFO *info)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0)
+  timer_setup(&info->tx_watchdog, emuc_watchdog, 0);
+#else
+  setup_timer(&info->tx_watchdog, emuc_watchdog, (unsigned long) info);
+#endif
+  INIT_WORK(&info->tx_stall_work, emuc_watchdog_event);
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+/* Bytes are left in xbuff: make sure the watchdog runs. Called with info->lock held. */
+void emuc_watchdog_arm (EMUC_RAW_INFO *info)
+{
+  if(tx_stall_ms && !timer_pending(&info->tx_watchdog))
+    mod_timer(&info->tx_watchdog, info->tx_progress + msecs_to_jiffies(tx_stall_ms));
+}
+
+/*---------------------------------------------------------------------------------------------------*/
+/* The tty is gone, info->tty is NULL already. Process context. */
+void emuc_watchdog_stop (EMUC_RAW_INFO *info)
+{
+  del_timer_sync(&info->tx_watchdog);
+  cancel_work_sync(&info->tx_stall_work);
+  info->tx_stall_stage = 0;
+}
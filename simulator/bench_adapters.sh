@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# Aggregate receive throughput of the driver with 1, 2 and 4 simulated
+# adapters. Every adapter is an emucsim sending RATE frames/s on each
+# channel with its own emucd; the frames the interfaces received are
+# counted over DURATION seconds.
+#
+# Needs root, the loaded emuc2socketcan module (persist=0) and the built
+# emucd_64 and emucsim. Run from the top of the source tree:
+#
+#   root@host# insmod driver/emuc2socketcan.ko
+#   root@host# RATE=20000 sh simulator/bench_adapters.sh 1 2 4
+#
+
+SIM=simulator/emucsim
+EMUCD=./emucd_64
+RATE=${RATE:-20000}
+DURATION=${DURATION:-10}
+PIDS=""
+
+stop_all ()
+{
+  [ -n "$PIDS" ] && kill $PIDS 2>/dev/null
+  wait 2>/dev/null
+  PIDS=""
+  rm -f /tmp/ttyEMUCbench*
+}
+trap stop_all EXIT
+
+rx_total ()
+{
+  total=0
+
+  for f in /sys/class/net/bench*/statistics/rx_packets; do
+    [ -e "$f" ] && total=$((total + $(cat $f)))
+  done
+
+  echo $total
+}
+
+[ -d /sys/module/emuc2socketcan ] || { echo "emuc2socketcan is not loaded"; exit 2; }
+grep -q Y /sys/module/emuc2socketcan/parameters/persist 2>/dev/null && { echo "needs persist=0"; exit 2; }
+
+for n in ${*:-1 2 4}; do
+  i=0
+
+  while [ $i -lt $n ]; do
+    $SIM -l /tmp/ttyEMUCbench$i -r $RATE -s 0 > /dev/null &
+    PIDS="$PIDS $!"
+    sleep 0.3
+
+    $EMUCD -F -s9 /tmp/ttyEMUCbench$i bench${i}a bench${i}b > /dev/null 2>&1 &
+    PIDS="$PIDS $!"
+    i=$((i + 1))
+  done
+
+  sleep 1
+
+  for dev in /sys/class/net/bench*; do
+    ip link set $(basename $dev) up
+  done
+
+  sleep 1
+  before=$(rx_total)
+  sleep $DURATION
+  after=$(rx_total)
+
+  rate=$(( (after - before) / DURATION ))
+  echo "$n adapter(s): $rate frames/s received, $((rate / n)) per adapter, $((2 * RATE * n)) offered"
+
+  stop_all
+  sleep 1
+done
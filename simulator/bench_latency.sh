@@ -0,0 +1,72 @@
+#!/bin/sh
+#
+# Per frame latency of the driver with and without the low latency profile
+# (emucd -L). emucsim sends RATE frames/s on each channel and loops the
+# host's frames back, a cyclic entry sends one frame per ms on channel 1.
+# The debugfs histograms are reset and read after DURATION seconds.
+#
+# Needs root, debugfs, the loaded emuc2socketcan module and the built
+# emucd_64 and emucsim. Run from the top of the source tree:
+#
+#   root@host# insmod driver/emuc2socketcan.ko
+#   root@host# RATE=2000 sh simulator/bench_latency.sh
+#
+# On a pty the tty flag of the profile has no effect, only the driver side
+# of it is measured.
+#
+
+SIM=simulator/emucsim
+EMUCD=./emucd_64
+TTY=/tmp/ttyEMUClat
+IF=lat0
+RATE=${RATE:-2000}
+DURATION=${DURATION:-10}
+PIDS=""
+
+stop_all ()
+{
+  [ -n "$PIDS" ] && kill $PIDS 2>/dev/null
+  wait 2>/dev/null
+  PIDS=""
+}
+trap stop_all EXIT
+
+# the histogram file of an interface, its first line is the current name
+lat_file ()
+{
+  for f in /sys/kernel/debug/emuc/*/latency; do
+    [ "$(head -1 $f)" = "$1" ] && { echo $f; return; }
+  done
+}
+
+[ -d /sys/module/emuc2socketcan ] || { echo "emuc2socketcan is not loaded"; exit 2; }
+[ -d /sys/kernel/debug/emuc ] || { echo "debugfs is not mounted"; exit 2; }
+
+for profile in normal low; do
+  [ $profile = low ] && L=-L || L=
+
+  $SIM -l $TTY -r $RATE -L -s 0 > /dev/null &
+  PIDS="$PIDS $!"
+  sleep 0.5
+
+  $EMUCD -F -s9 $L $TTY $IF lat1 > /dev/null 2>&1 &
+  PIDS="$PIDS $!"
+  sleep 1
+
+  ip link set $IF up
+  ip link set lat1 up
+  echo "add 123#11.22.33.44 1000" > /sys/class/net/$IF/emuc/cyclic
+
+  f=$(lat_file $IF)
+  [ -n "$f" ] || { echo "no latency histogram for $IF"; exit 1; }
+
+  sleep 1
+  echo 0 > $f
+  sleep $DURATION
+
+  echo "== $profile"
+  grep 'frames' $f
+
+  stop_all
+  sleep 1
+done
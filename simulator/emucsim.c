@@ -0,0 +1,773 @@
+/*
+ * emucsim - EMUC-B202 simulator on a pseudo-terminal
+ *
+ * Speaks the adapter's serial protocol on the master side of a pty, so
+ * emucd and the driver can be attached to the slave instead of a real
+ * /dev/ttyACM*, without an adapter or a CAN bus:
+ *
+ *   - replies to the init, bitrate, filter, mode, error type and version
+ *     commands like the adapter (filters are acknowledged, not applied)
+ *   - sends received frames (0xE1) on the active channels at a fixed rate,
+ *     with ids from a range, a share of extended ids and a dlc range; the
+ *     first data bytes carry a per channel sequence number (little endian)
+ *   - counts the frames sent by the host (0xE0), or with -L forwards them
+ *     to the other channel, like a cable between the two ports
+ *   - on SIGUSR1 / SIGUSR2 reports bus-off on channel 1 / 2, if the host
+ *     enabled bus error reports, and recovers after -b ms or when the host
+ *     sends init again
+ *
+ * Frames are built with ../driver/emuc_parse.c, like in emucd.
+ */
+
+#define _GNU_SOURCE   /* ptsname_r() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "emuc_parse.h"
+
+
+#define  SIM_RBUF       4096
+#define  SIM_TXQ        65536      /* bytes queued for the host, whole messages only */
+#define  SIM_TICK_NS    1000000    /* frames due are written once per ms */
+#define  SIM_BATCH      256        /* frames per channel and tick at most */
+
+#define  SIM_FW_MAJOR   0x02       /* CMD_HEAD_VER reply */
+#define  SIM_FW_MINOR   0x07
+#define  SIM_MODEL_HI   0xB2       /* CMD_HEAD_BLDID reply */
+#define  SIM_MODEL_LO   0x02
+
+/* epoll data */
+enum
+{
+  EV_PTY = 0,
+  EV_SIGNAL,
+  EV_TICK,
+  EV_SECOND,
+  EV_RECOVER
+};
+
+/*--------------------------------------*/
+typedef struct
+{
+  double         rate;             /* frames/s per channel, 0: none */
+  int            channels;         /* bit 0: channel 1, bit 1: channel 2 */
+  unsigned int   id_lo;
+  unsigned int   id_hi;
+  int            ext_pct;          /* extended frames in % */
+  int            dlc_lo;
+  int            dlc_hi;
+  int            loop;             /* host frames go out on the other channel */
+  int            stats;            /* s between statistics, 0: only at the end */
+  int            duration;         /* s, 0: until SIGINT or SIGTERM */
+  int            recover_ms;       /* bus-off to error-active, 0: only by init */
+  const char    *link;             /* symlink to the pty slave */
+
+} SIM_CONF;
+
+typedef struct
+{
+  unsigned long  to_host;          /* 0xE1 frames written */
+  unsigned long  from_host;        /* 0xE0 frames received */
+  unsigned long  dropped;          /* 0xE1 frames the host did not take in time */
+
+} SIM_COUNT;
+
+typedef struct
+{
+  int            active;           /* CMD_HEAD_INIT */
+  int            mode;             /* CMD_HEAD_MODE */
+  int            baud;             /* CMD_HEAD_BAUD */
+  int            bus_off;          /* SIGUSR1 / SIGUSR2 */
+  unsigned int   seq;
+
+  struct timespec t0;              /* emission start, when the channel became active */
+  unsigned long  emitted;          /* frames generated since t0 */
+
+  SIM_COUNT      cnt;
+  SIM_COUNT      last;             /* at the previous statistics line */
+
+} SIM_CHANNEL;
+
+
+static SIM_CONF       conf = { .channels = 3, .id_lo = 0x100, .id_hi = 0x1FF, .dlc_lo = 8, .dlc_hi = 8, .stats = 1,
+                               .recover_ms = 500 };
+static SIM_CHANNEL    ch[2];
+static int            pty = -1;
+static int            rec_fd = -1;               /* bus-off recovery timer */
+static unsigned char  txq[SIM_TXQ];
+static int            txq_len = 0;
+static int            err_type = EMUC_DIS_ALL;   /* CMD_HEAD_ERRTYPE */
+static unsigned long  commands = 0;
+static unsigned long  skipped = 0;   /* bytes skipped to find the next message */
+
+static int   host_input   (const unsigned char *buf, int len);
+static int   host_cmd_len (unsigned char head);
+static void  host_cmd     (const unsigned char *cmd);
+static void  host_frame   (unsigned char *frame);
+static void  emit_due     (const struct timespec *now);
+static void  make_frame   (int port, unsigned char *frame);
+static void  set_bus_off  (int port, int on);
+static int   sum_ok       (const unsigned char *msg, int len);
+static void  set_sum      (unsigned char *msg, int len);
+static int   txq_add      (const unsigned char *msg, int len);
+static void  txq_flush    (void);
+static void  print_stats  (double seconds, int total);
+static void  print_usage  (char *prg);
+
+
+/*------------------------------------------------------------------------------------*/
+int main (int argc, char *argv[])
+{
+  int                  opt, ep, sfd, tfd, sec_fd, slave, n, used, i;
+  int                  running = 1, seconds = 0;
+  char                *p;
+  char                 slave_name[64];
+  sigset_t             sigs;
+  struct signalfd_siginfo  si;
+  struct epoll_event   ev;
+  struct termios       tios;
+  struct itimerspec    its;
+  struct timespec      now, start;
+  unsigned char        rbuf[SIM_RBUF];
+  int                  rlen = 0;
+  unsigned long long   ticks;
+
+  while((opt = getopt(argc, argv, "r:c:i:x:d:Ls:t:l:b:h")) != -1)
+  {
+    switch(opt)
+    {
+      case 'r':
+                conf.rate = atof(optarg);
+                break;
+      case 'c':
+                conf.channels = 0;
+                for(p=optarg; *p; p++)
+                {
+                  if(*p != '1' && *p != '2')
+                    print_usage(argv[0]);
+                  conf.channels |= 1 << (*p - '1');
+                }
+                break;
+      case 'i':
+                conf.id_lo = strtoul(optarg, &p, 16);
+                conf.id_hi = *p == '-' ? strtoul(p + 1, NULL, 16) : conf.id_lo;
+                break;
+      case 'x':
+                conf.ext_pct = atoi(optarg);
+                break;
+      case 'd':
+                conf.dlc_lo = strtol(optarg, &p, 10);
+                conf.dlc_hi = *p == '-' ? atoi(p + 1) : conf.dlc_lo;
+                break;
+      case 'L':
+                conf.loop = 1;
+                break;
+      case 's':
+                conf.stats = atoi(optarg);
+                break;
+      case 't':
+                conf.duration = atoi(optarg);
+                break;
+      case 'l':
+                conf.link = optarg;
+                break;
+      case 'b':
+                conf.recover_ms = atoi(optarg);
+                break;
+      case 'h':
+      default:
+                print_usage(argv[0]);
+                break;
+    }
+  }
+
+  if(optind != argc || conf.rate < 0 || conf.id_hi < conf.id_lo || conf.id_hi > 0x1FFFFFFF ||
+     conf.ext_pct < 0 || conf.ext_pct > 100 || conf.dlc_lo < 0 || conf.dlc_hi < conf.dlc_lo ||
+     conf.dlc_hi > DATA_LEN || conf.stats < 0 || conf.duration < 0 || conf.recover_ms < 0)
+    print_usage(argv[0]);
+
+  /* the adapter's side of the link */
+  pty = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if(pty < 0 || grantpt(pty) < 0 || unlockpt(pty) < 0 || ptsname_r(pty, slave_name, sizeof(slave_name)))
+  {
+    perror("posix_openpt");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Hold the slave open ourselves, otherwise the master reports a hangup
+   * until the host opens it and again each time it closes it. Raw, so the
+   * frames are not echoed back before the host has set up the tty.
+   */
+  slave = open(slave_name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if(slave < 0 || tcgetattr(slave, &tios) < 0)
+  {
+    perror(slave_name);
+    exit(EXIT_FAILURE);
+  }
+
+  cfmakeraw(&tios);
+  tcsetattr(slave, TCSANOW, &tios);
+
+  if(conf.link)
+  {
+    unlink(conf.link);
+
+    if(symlink(slave_name, conf.link) < 0)
+    {
+      perror(conf.link);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  sigaddset(&sigs, SIGUSR1);
+  sigaddset(&sigs, SIGUSR2);
+  sigprocmask(SIG_BLOCK, &sigs, NULL);
+
+  sfd    = signalfd(-1, &sigs, SFD_CLOEXEC);
+  tfd    = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  sec_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  rec_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  ep     = epoll_create1(EPOLL_CLOEXEC);
+
+  if(sfd < 0 || tfd < 0 || sec_fd < 0 || rec_fd < 0 || ep < 0)
+  {
+    perror("emucsim");
+    exit(EXIT_FAILURE);
+  }
+
+  ev.events   = EPOLLIN;
+  ev.data.u64 = EV_PTY;
+  epoll_ctl(ep, EPOLL_CTL_ADD, pty, &ev);
+  ev.data.u64 = EV_SIGNAL;
+  epoll_ctl(ep, EPOLL_CTL_ADD, sfd, &ev);
+  ev.data.u64 = EV_TICK;
+  epoll_ctl(ep, EPOLL_CTL_ADD, tfd, &ev);
+  ev.data.u64 = EV_SECOND;
+  epoll_ctl(ep, EPOLL_CTL_ADD, sec_fd, &ev);
+  ev.data.u64 = EV_RECOVER;
+  epoll_ctl(ep, EPOLL_CTL_ADD, rec_fd, &ev);
+
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_nsec    = SIM_TICK_NS;
+  its.it_interval.tv_nsec = SIM_TICK_NS;
+  timerfd_settime(tfd, 0, &its, NULL);
+
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec    = 1;
+  its.it_interval.tv_sec = 1;
+  timerfd_settime(sec_fd, 0, &its, NULL);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  srandom(start.tv_nsec ^ getpid());
+
+  printf("EMUC-B202 simulator on %s%s%s\n", slave_name, conf.link ? " -> " : "", conf.link ? conf.link : "");
+  printf("attach with: emucd_64 -F -s6 %s\n", conf.link ? conf.link : slave_name);
+  fflush(stdout);
+
+  while(running)
+  {
+    if(epoll_wait(ep, &ev, 1, -1) <= 0)
+      continue;
+
+    switch(ev.data.u64)
+    {
+      case EV_PTY:
+                /* what the host wrote to the slave */
+                while((n = read(pty, rbuf + rlen, sizeof(rbuf) - rlen)) > 0)
+                {
+                  rlen += n;
+                  used  = host_input(rbuf, rlen);
+                  rlen -= used;
+                  memmove(rbuf, rbuf + used, rlen);
+                }
+                txq_flush();
+                break;
+
+      case EV_TICK:
+                if(read(tfd, &ticks, sizeof(ticks)) != sizeof(ticks))
+                  break;
+
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                emit_due(&now);
+                txq_flush();
+                break;
+
+      case EV_SECOND:
+                if(read(sec_fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+                  break;
+
+                seconds += ticks;
+
+                if(conf.stats && !(seconds % conf.stats))
+                  print_stats(conf.stats, 0);
+
+                if(conf.duration && seconds >= conf.duration)
+                  running = 0;
+                break;
+
+      case EV_RECOVER:
+                if(read(rec_fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+                  break;
+
+                for(i=0; i<2; i++)
+                {
+                  if(ch[i].bus_off)
+                    set_bus_off(i, 0);
+                }
+                txq_flush();
+                break;
+
+      case EV_SIGNAL:
+                if(read(sfd, &si, sizeof(si)) != sizeof(si))
+                  break;
+
+                if(si.ssi_signo == SIGUSR1 || si.ssi_signo == SIGUSR2)
+                {
+                  set_bus_off(si.ssi_signo == SIGUSR1 ? EMUC_CAN_1 : EMUC_CAN_2, 1);
+                  txq_flush();
+                }
+                else
+                  running = 0;
+                break;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  print_stats((now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9, 1);
+
+  if(conf.link)
+    unlink(conf.link);
+
+  close(slave);
+  close(pty);
+  return EXIT_SUCCESS;
+}
+
+/*------------------------------------------------------------------------------------*/
+/* Handles the complete messages in buf, returns the number of bytes used. */
+static int host_input (const unsigned char *buf, int len)
+{
+  int  pos = 0, n;
+
+  while(pos < len)
+  {
+    n = host_cmd_len(buf[pos]);
+
+    if(!n)
+    {
+      skipped++;
+      pos++;
+      continue;
+    }
+
+    if(len - pos < n)
+      break;
+
+    if(!sum_ok(buf + pos, n))
+    {
+      skipped++;
+      pos++;
+      continue;
+    }
+
+    if(buf[pos] == CMD_HEAD_SEND)
+      host_frame((unsigned char *) buf + pos);
+    else
+      host_cmd(buf + pos);
+
+    pos += n;
+  }
+
+  return pos;
+}
+
+/*------------------------------------------------------------------------------------*/
+/* length of a message from the host, 0 if the head is unknown */
+static int host_cmd_len (unsigned char head)
+{
+  switch(head)
+  {
+    case CMD_HEAD_VER:
+    case CMD_HEAD_BLDID:
+      return 4;
+
+    case CMD_HEAD_ERRTYPE:
+      return 5;
+
+    case CMD_HEAD_INIT:
+    case CMD_HEAD_BAUD:
+    case CMD_HEAD_MODE:
+      return 6;
+
+    case CMD_HEAD_FILTER:
+    case CMD_HEAD_FILTER + 1:
+      return CMD_MAX_LEN;
+
+    case CMD_HEAD_SEND:
+      return COM_BUF_LEN;
+
+    default:
+      return 0;
+  }
+}
+
+/*------------------------------------------------------------------------------------*/
+/* a complete command, host_input() checked its length and sum */
+static void host_cmd (const unsigned char *cmd)
+{
+  unsigned char    reply[CMD_VER_LEN];
+  struct timespec  now;
+  int              i, restart[2] = { 0, 0 };
+
+  commands++;
+
+  switch(cmd[0])
+  {
+    case CMD_HEAD_INIT:
+              clock_gettime(CLOCK_MONOTONIC, &now);
+
+              for(i=0; i<2; i++)
+              {
+                if(cmd[1 + i] == EMUC_ACTIVE && !ch[i].active)
+                {
+                  ch[i].t0      = now;
+                  ch[i].emitted = 0;
+                }
+                ch[i].active = cmd[1 + i] == EMUC_ACTIVE;
+
+                /* init restarts a controller that is bus-off */
+                restart[i] = ch[i].bus_off && ch[i].active;
+              }
+              break;
+
+    case CMD_HEAD_BAUD:
+              ch[0].baud = cmd[1];
+              ch[1].baud = cmd[2];
+              break;
+
+    case CMD_HEAD_MODE:
+              ch[0].mode = cmd[1];
+              ch[1].mode = cmd[2];
+              break;
+
+    case CMD_HEAD_ERRTYPE:
+              err_type = cmd[1];
+              break;
+  }
+
+  reply[0] = cmd[0];
+  reply[1] = 0x00;
+
+  if(EMUCReplyLen(cmd[0]) == CMD_VER_LEN)
+  {
+    reply[2] = cmd[0] == CMD_HEAD_VER ? SIM_FW_MAJOR : SIM_MODEL_HI;
+    reply[3] = cmd[0] == CMD_HEAD_VER ? SIM_FW_MINOR : SIM_MODEL_LO;
+    set_sum(reply, CMD_VER_LEN);
+    txq_add(reply, CMD_VER_LEN);
+  }
+  else
+  {
+    set_sum(reply, CMD_REPLY_LEN);
+    txq_add(reply, CMD_REPLY_LEN);
+  }
+
+  /* reported after the reply */
+  for(i=0; i<2; i++)
+  {
+    if(restart[i])
+      set_bus_off(i, 0);
+  }
+}
+
+/*------------------------------------------------------------------------------------*/
+/* A frame sent by the host; with -L it is received on the other channel. */
+static void host_frame (unsigned char *frame)
+{
+  int  port = (frame[1] & 0x03) - 1;
+  int  other;
+
+  if(port != EMUC_CAN_1 && port != EMUC_CAN_2)
+  {
+    skipped += COM_BUF_LEN;
+    return;
+  }
+
+  ch[port].cnt.from_host++;
+  other = !port;
+
+  if(!conf.loop || !ch[other].active || ch[other].bus_off || ch[port].bus_off || ch[port].mode == EMUC_LISTEN)
+    return;
+
+  frame[0] = CMD_HEAD_RECV;
+  frame[1] = (frame[1] & ~0x03) | (other + 1);
+  set_sum(frame, COM_BUF_LEN);
+
+  if(txq_add(frame, COM_BUF_LEN))
+    ch[other].cnt.to_host++;
+  else
+    ch[other].cnt.dropped++;
+}
+
+/*------------------------------------------------------------------------------------*/
+/* Generates the frames due on the active channels, alternating between them. */
+static void emit_due (const struct timespec *now)
+{
+  unsigned char  frame[COM_BUF_LEN];
+  unsigned long  due[2];
+  double         t;
+  int            i, more;
+
+  if(conf.rate <= 0)
+    return;
+
+  for(i=0; i<2; i++)
+  {
+    due[i] = 0;
+
+    if(!ch[i].active || ch[i].bus_off || !(conf.channels & (1 << i)))
+      continue;
+
+    t = (now->tv_sec - ch[i].t0.tv_sec) + (now->tv_nsec - ch[i].t0.tv_nsec) / 1e9;
+    due[i] = (unsigned long) (conf.rate * t) - ch[i].emitted;
+
+    /* after a long stall the rest is given up rather than sent in a burst */
+    if(due[i] > SIM_BATCH)
+    {
+      ch[i].cnt.dropped += due[i] - SIM_BATCH;
+      ch[i].seq         += due[i] - SIM_BATCH;
+      ch[i].emitted     += due[i] - SIM_BATCH;
+      due[i] = SIM_BATCH;
+    }
+  }
+
+  do
+  {
+    more = 0;
+
+    for(i=0; i<2; i++)
+    {
+      if(!due[i])
+        continue;
+
+      make_frame(i, frame);
+
+      if(txq_add(frame, COM_BUF_LEN))
+        ch[i].cnt.to_host++;
+      else
+        ch[i].cnt.dropped++;
+
+      ch[i].emitted++;
+      more |= --due[i] != 0;
+    }
+
+  } while(more);
+}
+
+/*------------------------------------------------------------------------------------*/
+static void make_frame (int port, unsigned char *frame)
+{
+  EMUC_CAN_FRAME  f;
+  unsigned int    id, seq;
+  int             i;
+
+  memset(&f, 0, sizeof(f));
+
+  id  = conf.id_lo + (unsigned int) (random() % (conf.id_hi - conf.id_lo + 1));
+  seq = ch[port].seq++;
+
+  f.CAN_port = port;
+  f.id_type  = (id > 0x7FF || random() % 100 < conf.ext_pct) ? EMUC_EID : EMUC_SID;
+  f.dlc      = conf.dlc_lo + (int) (random() % (conf.dlc_hi - conf.dlc_lo + 1));
+
+  for(i=0; i<ID_LEN; i++)
+    f.id[i] = (unsigned char) (id >> (8 * (ID_LEN - 1 - i)));
+
+  for(i=0; i<f.dlc && i<4; i++)
+    f.data[i] = (unsigned char) (seq >> (8 * i));
+
+  /* same layout as a host frame, only the head differs */
+  EMUCSendHex(&f);
+  f.com_buf[0] = CMD_HEAD_RECV;
+  set_sum(f.com_buf, COM_BUF_LEN);
+
+  memcpy(frame, f.com_buf, COM_BUF_LEN);
+}
+
+/*------------------------------------------------------------------------------------*/
+/* Puts a channel in or out of bus-off and sends a bus error report, like the
+ * adapter does when the host enabled them with CMD_HEAD_ERRTYPE.
+ */
+static void set_bus_off (int port, int on)
+{
+  unsigned char      report[COM_BUF_LEN];
+  struct itimerspec  its;
+  int                i;
+
+  ch[port].bus_off = on;
+
+  if(on && conf.recover_ms)
+  {
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec  = conf.recover_ms / 1000;
+    its.it_value.tv_nsec = (conf.recover_ms % 1000) * 1000000L;
+    timerfd_settime(rec_fd, 0, &its, NULL);
+  }
+
+  if(!on)
+  {
+    /* frames are not caught up */
+    clock_gettime(CLOCK_MONOTONIC, &ch[port].t0);
+    ch[port].emitted = 0;
+  }
+
+  printf("ch%d %s%s\n", port + 1, on ? "bus-off" : "error-active",
+         (err_type == EMUC_BUS_ERR || err_type == EMUC_EN_ALL) ? "" : " (not reported, error reports are off)");
+  fflush(stdout);
+
+  if(err_type != EMUC_BUS_ERR && err_type != EMUC_EN_ALL)
+    return;
+
+  memset(report, 0, sizeof(report));
+  report[0] = CMD_HEAD_ERR;
+  report[1] = ERR_TYPE_BUS;
+
+  for(i=0; i<2; i++)
+  {
+    if(ch[i].bus_off)
+    {
+      report[2 + i * ERR_DATA_LEN + ERR_TEC]   = 0xFF;
+      report[2 + i * ERR_DATA_LEN + ERR_FLAGS] = ERR_FLAG_BUSOFF;
+    }
+  }
+
+  set_sum(report, COM_BUF_LEN);
+  txq_add(report, COM_BUF_LEN);
+}
+
+/*------------------------------------------------------------------------------------*/
+/* checksum: sum of all bytes before it, followed by 0D 0A */
+static int sum_ok (const unsigned char *msg, int len)
+{
+  unsigned char  sum = 0x00;
+  int            i;
+
+  for(i=0; i<len-3; i++)
+    sum += msg[i];
+
+  return msg[len - 3] == sum && msg[len - 2] == 0x0D && msg[len - 1] == 0x0A;
+}
+
+/*------------------------------------------------------------------------------------*/
+static void set_sum (unsigned char *msg, int len)
+{
+  unsigned char  sum = 0x00;
+  int            i;
+
+  for(i=0; i<len-3; i++)
+    sum += msg[i];
+
+  msg[len - 3] = sum;
+  msg[len - 2] = 0x0D;
+  msg[len - 1] = 0x0A;
+}
+
+/*------------------------------------------------------------------------------------*/
+/* Queues a whole message for the host, 0 if there is no room for it. */
+static int txq_add (const unsigned char *msg, int len)
+{
+  if(txq_len + len > SIM_TXQ)
+    return 0;
+
+  memcpy(txq + txq_len, msg, len);
+  txq_len += len;
+  return 1;
+}
+
+/*------------------------------------------------------------------------------------*/
+/* Writes what the pty takes; a partial message is finished on the next call. */
+static void txq_flush (void)
+{
+  int  n;
+
+  while(txq_len > 0)
+  {
+    n = write(pty, txq, txq_len);
+
+    if(n <= 0)
+    {
+      if(n < 0 && errno != EAGAIN && errno != EINTR)
+        txq_len = 0;
+      break;
+    }
+
+    txq_len -= n;
+    memmove(txq, txq + n, txq_len);
+  }
+}
+
+/*------------------------------------------------------------------------------------*/
+/* Frames per second since the previous line, or the totals at the end. */
+static void print_stats (double seconds, int total)
+{
+  SIM_COUNT  *c, *l;
+  int         i;
+
+  if(seconds <= 0)
+    return;
+
+  for(i=0; i<2; i++)
+  {
+    c = &ch[i].cnt;
+    l = &ch[i].last;
+
+    if(total)
+      printf("ch%d: rx %lu  tx %lu  dropped %lu  |  ", i + 1, c->to_host, c->from_host, c->dropped);
+    else
+      printf("ch%d %-3s %7u: rx %6.0f/s  tx %6.0f/s  dropped %lu  |  ", i + 1, ch[i].active ? "on" : "off",
+             EMUCBaudBitrate(ch[i].baud), (c->to_host - l->to_host) / seconds,
+             (c->from_host - l->from_host) / seconds, c->dropped - l->dropped);
+
+    *l = *c;
+  }
+
+  printf("commands %lu  skipped %lu%s\n", commands, skipped, total ? "  (total)" : "");
+  fflush(stdout);
+}
+
+/*------------------------------------------------------------------------------------*/
+static void print_usage (char *prg)
+{
+  fprintf(stderr, "\nUsage: %s [options]\n\n", prg);
+  fprintf(stderr, "Options: -r <fps>      (frames per second sent on each channel, default 0)\n");
+  fprintf(stderr, "         -c <1|2|12>   (channels that send, default 12)\n");
+  fprintf(stderr, "         -i <id>[-<id>] (hex id range, default 100-1FF; ids above 7FF are extended)\n");
+  fprintf(stderr, "         -x <pct>      (share of extended frames in %%, default 0)\n");
+  fprintf(stderr, "         -d <dlc>[-<dlc>] (dlc range, default 8)\n");
+  fprintf(stderr, "         -L            (loop frames from the host to the other channel)\n");
+  fprintf(stderr, "         -s <sec>      (statistics interval, 0: only at the end, default 1)\n");
+  fprintf(stderr, "         -t <sec>      (run time, default until SIGINT)\n");
+  fprintf(stderr, "         -l <path>     (symlink to the pty slave)\n");
+  fprintf(stderr, "         -b <ms>       (bus-off recovery time, 0: only by init, default 500)\n");
+  fprintf(stderr, "         -h            (show this help page)\n");
+  fprintf(stderr, "\nrx: frames to the host, tx: frames from the host\n");
+  fprintf(stderr, "SIGUSR1 / SIGUSR2: bus-off on channel 1 / 2\n");
+  fprintf(stderr, "\nExamples:\n");
+  fprintf(stderr, "emucsim -l /tmp/ttyEMUC -r 2000 -i 100-7FF -x 25 -d 0-8\n");
+  fprintf(stderr, "emucsim -l /tmp/ttyEMUC -L\n");
+  fprintf(stderr, "\n");
+  exit(EXIT_FAILURE);
+}
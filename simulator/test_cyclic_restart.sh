@@ -0,0 +1,80 @@
+#!/bin/sh
+#
+# Cyclic frames resume after a bus-off, through both recovery paths:
+#   1. restart-ms 0:   the adapter reports error-active on its own
+#   2. restart-ms 100: the can core restarts the channel
+#
+# Needs root, the loaded emuc2socketcan module and the built emucd_64 and
+# emucsim. Run from the top of the source tree:
+#
+#   root@host# insmod driver/emuc2socketcan.ko
+#   root@host# sh simulator/test_cyclic_restart.sh
+#
+
+SIM=simulator/emucsim
+EMUCD=./emucd_64
+TTY=/tmp/ttyEMUCtest
+IF=emucsim0
+LOG=$(mktemp)
+FAILED=0
+
+cleanup ()
+{
+  [ -n "$EMUCD_PID" ] && kill $EMUCD_PID 2>/dev/null
+  [ -n "$SIM_PID" ] && kill $SIM_PID 2>/dev/null
+  wait 2>/dev/null
+  rm -f $LOG
+}
+trap cleanup EXIT
+
+# frames per second the host sent on channel 1 in the last statistics line
+ch1_tx ()
+{
+  grep '^ch1 on' $LOG | tail -1 | sed -n 's|^ch1 [^|]* tx *\([0-9]*\)/s.*|\1|p'
+}
+
+check ()
+{
+  tx=$(ch1_tx)
+
+  if [ -n "$tx" ] && [ "$tx" -ge 80 ]; then
+    echo "ok:   $1 ($tx frames/s)"
+  else
+    echo "FAIL: $1 (${tx:-no} frames/s, expected 100)"
+    FAILED=1
+  fi
+}
+
+[ -d /sys/module/emuc2socketcan ] || { echo "emuc2socketcan is not loaded"; exit 2; }
+
+$SIM -l $TTY -b 500 > $LOG &
+SIM_PID=$!
+sleep 0.5
+
+$EMUCD -F -s6 $TTY $IF emucsim1 > /dev/null 2>&1 &
+EMUCD_PID=$!
+sleep 1
+
+# 100 frames/s on channel 1
+ip link set $IF type can restart-ms 0
+ip link set $IF up
+echo "add 123#11.22 10000" > /sys/class/net/$IF/emuc/cyclic
+sleep 2
+check "cyclic frames before bus-off"
+
+kill -USR1 $SIM_PID
+sleep 3
+check "cyclic frames after the adapter recovered (restart-ms 0)"
+
+ip link set $IF down
+ip link set $IF type can restart-ms 100
+ip link set $IF up
+sleep 2
+
+kill -USR1 $SIM_PID
+sleep 3
+check "cyclic frames after the can core restart (restart-ms 100)"
+
+grep -q 'bus-off' $LOG || { echo "FAIL: no bus-off was simulated"; FAILED=1; }
+
+exit $FAILED
@@ -0,0 +1,257 @@
+/*
+ * emuc_cmd.c - EMUC-B202 control commands for emucd
+ *
+ * The commands are framed by emuc_parse.c, shared with the driver. A batch
+ * of commands is written in one go and the replies are collected as they
+ * arrive, so configuring the device costs one round trip instead of one
+ * per command.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+
+#include "emuc_cmd.h"
+
+
+/*------------------------------------------------------------------------------------*/
+static long now_ms (void)
+{
+  struct timespec  ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/*------------------------------------------------------------------------------------*/
+/* Open the tty in raw mode at the command baud rate. Returns the fd or -1. */
+int EMUCOpenDevice (const char *tty)
+{
+  int             fd;
+  struct termios  tios;
+
+  fd = open(tty, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if(fd < 0)
+    return -1;
+
+  if(tcgetattr(fd, &tios) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+
+  cfmakeraw(&tios);
+  tios.c_iflag &= ~IXOFF;
+  tios.c_cflag &= ~CRTSCTS;
+  tios.c_cflag |= CLOCAL | CREAD;
+  cfsetispeed(&tios, B9600);
+  cfsetospeed(&tios, B9600);
+
+  if(tcsetattr(fd, TCSANOW, &tios) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/*------------------------------------------------------------------------------------*/
+void EMUCCloseDevice (int fd)
+{
+  if(fd >= 0)
+    close(fd);
+}
+
+/*------------------------------------------------------------------------------------*/
+static int write_all (int fd, const unsigned char *buf, int len, long deadline)
+{
+  struct pollfd  pfd = { .fd = fd, .events = POLLOUT };
+  int            n;
+
+  while(len > 0)
+  {
+    n = write(fd, buf, len);
+
+    if(n > 0)
+    {
+      buf += n;
+      len -= n;
+      continue;
+    }
+
+    if(n < 0 && errno != EAGAIN && errno != EINTR)
+      return -1;
+
+    if(now_ms() >= deadline || (poll(&pfd, 1, deadline - now_ms()) < 0 && errno != EINTR))
+      return -1;
+  }
+
+  return 0;
+}
+
+/*------------------------------------------------------------------------------------*/
+/* Match the replies at the start of buf to the commands still waiting for
+ * one, skipping bytes that do not start a reply. Returns the bytes used.
+ */
+static int match_replies (EMUC_CMD *cmds, int cnt, const unsigned char *buf, int len, int *pending)
+{
+  int  pos = 0;
+  int  rlen, status, i;
+
+  while(pos < len)
+  {
+    rlen = EMUCReplyLen(buf[pos]);
+
+    if(!rlen)
+    {
+      pos++;
+      continue;
+    }
+
+    if(len - pos < rlen)
+      break;
+
+    status = EMUCReplyHex(buf + pos, rlen);
+    if(status < 0)
+    {
+      pos++;
+      continue;
+    }
+
+    /* the device answers in order, the first waiting command with this head gets it */
+    for(i=0; i<cnt; i++)
+    {
+      if(cmds[i].status < 0 && cmds[i].cmd[0] == buf[pos])
+      {
+        memcpy(cmds[i].reply, buf + pos, rlen);
+        cmds[i].status = status;
+        (*pending)--;
+        break;
+      }
+    }
+
+    pos += rlen;
+  }
+
+  return pos;
+}
+
+/*------------------------------------------------------------------------------------*/
+/* Send cnt commands in one write and wait up to timeout_ms for all replies.
+ * Returns the number of commands that failed or got no reply, 0 if all succeeded.
+ */
+int EMUCRunCmd (int fd, EMUC_CMD *cmds, int cnt, int timeout_ms)
+{
+  unsigned char  wbuf[cnt * CMD_MAX_LEN];
+  unsigned char  rbuf[64];
+  int            wlen = 0;
+  int            rlen = 0;
+  int            pending = cnt;
+  int            failed = 0;
+  int            i, n, used;
+  long           deadline = now_ms() + timeout_ms;
+  struct pollfd  pfd = { .fd = fd, .events = POLLIN };
+
+  for(i=0; i<cnt; i++)
+  {
+    memcpy(wbuf + wlen, cmds[i].cmd, cmds[i].len);
+    wlen += cmds[i].len;
+    cmds[i].status = -1;
+  }
+
+  /* stale bytes would be taken for replies */
+  tcflush(fd, TCIFLUSH);
+
+  if(write_all(fd, wbuf, wlen, deadline) < 0)
+    return cnt;
+
+  while(pending > 0 && now_ms() < deadline)
+  {
+    n = poll(&pfd, 1, deadline - now_ms());
+
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      break;
+
+    n = read(fd, rbuf + rlen, sizeof(rbuf) - rlen);
+
+    if(n < 0 && (errno == EAGAIN || errno == EINTR))
+      continue;
+    if(n <= 0)
+      break;
+
+    rlen += n;
+    used  = match_replies(cmds, cnt, rbuf, rlen, &pending);
+    rlen -= used;
+    memmove(rbuf, rbuf + used, rlen);
+  }
+
+  for(i=0; i<cnt; i++)
+  {
+    if(cmds[i].status != 0)
+      failed++;
+  }
+
+  return failed;
+}
+
+/*------------------------------------------------------------------------------------*/
+int EMUCShowVer (int fd, VER_INFO *ver_info)
+{
+  EMUC_CMD  cmds[2];
+
+  memset(ver_info, 0, sizeof(VER_INFO));
+
+  cmds[0].len = EMUCQueryHex(CMD_HEAD_VER,   cmds[0].cmd);
+  cmds[1].len = EMUCQueryHex(CMD_HEAD_BLDID, cmds[1].cmd);
+
+  if(EMUCRunCmd(fd, cmds, 2, EMUC_CMD_TIMEOUT))
+    return 1;
+
+  snprintf(ver_info->fw,    VER_LEN, "%02X.%02X", cmds[0].reply[2], cmds[0].reply[3]);
+  snprintf(ver_info->model, VER_LEN, "%02X%02X",  cmds[1].reply[2], cmds[1].reply[3]);
+
+  return 0;
+}
+
+/*------------------------------------------------------------------------------------*/
+void EMUCCmdInit (EMUC_CMD *c, int CAN1_sts, int CAN2_sts)
+{
+  c->cmd[0] = CMD_HEAD_INIT;
+  c->cmd[4] = 0x0D;
+  c->cmd[5] = 0x0A;
+  EMUCInitHex(CAN1_sts, CAN2_sts, c->cmd);
+  c->len = 6;
+}
+
+/*------------------------------------------------------------------------------------*/
+void EMUCCmdBaud (EMUC_CMD *c, int CAN1_baud, int CAN2_baud)
+{
+  EMUCBaudHex(CAN1_baud, CAN2_baud, c->cmd);
+  c->len = 6;
+}
+
+/*------------------------------------------------------------------------------------*/
+void EMUCCmdMode (EMUC_CMD *c, int CAN1_mode, int CAN2_mode)
+{
+  c->len = EMUCModeHex(CAN1_mode, CAN2_mode, c->cmd);
+}
+
+/*------------------------------------------------------------------------------------*/
+void EMUCCmdErrType (EMUC_CMD *c, int err_type)
+{
+  c->len = EMUCErrTypeHex(err_type, c->cmd);
+}
+
+/*------------------------------------------------------------------------------------*/
+void EMUCCmdClrFilter (EMUC_CMD *c, int CAN_port)
+{
+  c->len = EMUCFilterHex(CAN_port, 0, 0, 0, c->cmd);
+}
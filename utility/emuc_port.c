@@ -0,0 +1,340 @@
+/*
+ * emuc_port.c - attach the emuc line discipline to one adapter
+ *
+ * Used by the single adapter daemon and, from several threads at once,
+ * by the supervisor. Everything here only touches the EMUC_PORT passed in.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/sockios.h>
+#include <linux/serial.h>
+
+#include "emuc_port.h"
+
+static int         reset_2_default    (int fd, int CAN1_baud, int CAN2_baud);
+static void        serial_low_latency (EMUC_PORT *p, int fd);
+
+
+/*------------------------------------------------------------------------------------*/
+/* Configure the adapter on p->tty, attach the ldisc and name its interfaces.
+ * Returns 0 with p->fd and p->ifname set, or -1.
+ */
+int EMUCPortAttach (EMUC_PORT *p)
+{
+  int             port, fd, channel;
+  int             ldisc = N_EMUC;
+  char            buf[IFNAMSIZ + 1];
+  struct termios  tios;
+
+  p->fd = -1;
+  p->old_serial_flags = -1;
+
+  /* Configure the device before attaching the line discipline */
+  if(p->baud[0])
+  {
+    port = EMUCOpenDevice(p->tty);
+    if(port < 0)
+    {
+      emucd_log(LOG_ERR, "fail to open comport: %s: %s", p->tty, strerror(errno));
+      return -1;
+    }
+
+    if(reset_2_default(port, p->baud[0], p->baud[1]))
+    {
+      EMUCCloseDevice(port);
+      return -1;
+    }
+
+    /* emuc active from driver (module version: v2.5) */
+    EMUCCloseDevice(port);
+
+    if(p->baud[0] == p->baud[1])
+      emucd_log(LOG_INFO, "%s: set can speed to %s on both channel", p->tty, EMUCSpeedName(p->baud[0]));
+    else
+      emucd_log(LOG_INFO, "%s: set can speed to %s on channel 1, %s on channel 2", p->tty,
+                EMUCSpeedName(p->baud[0]), EMUCSpeedName(p->baud[1]));
+  }
+
+  fd = open(p->tty, O_RDWR | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+  if(fd < 0)
+  {
+    emucd_log(LOG_NOTICE, "failed to open TTY device %s: %s", p->tty, strerror(errno));
+    return -1;
+  }
+
+  /* Configure baud rate */
+  memset(&tios, 0, sizeof(struct termios));
+  if(tcgetattr(fd, &tios) < 0)
+  {
+    emucd_log(LOG_NOTICE, "failed to get attributes for TTY device %s: %s", p->tty, strerror(errno));
+    goto ERR;
+  }
+
+  /* Get old values for later restore */
+  p->old_ispeed = cfgetispeed(&tios);
+  p->old_ospeed = cfgetospeed(&tios);
+
+  /* Reset UART settings */
+  cfmakeraw(&tios);
+  tios.c_iflag &= ~IXOFF;
+  tios.c_cflag &= ~CRTSCTS;
+
+  /* Baud Rate: the adapter is a CDC-ACM device and ignores it, the
+   * link latency depends on how the tty pushes data instead (-L)
+   */
+  cfsetispeed(&tios, B9600);
+  cfsetospeed(&tios, B9600);
+
+  /* apply changes */
+  if(tcsetattr(fd, TCSADRAIN, &tios) < 0)
+    emucd_log(LOG_NOTICE, "Cannot set attributes for device \"%s\": %s!", p->tty, strerror(errno));
+
+  if(p->low_latency)
+    serial_low_latency(p, fd);
+
+  /* set slcan like discipline on given tty */
+  if(ioctl(fd, TIOCSETD, &ldisc) < 0)
+  {
+    emucd_log(LOG_ERR, "%s: ioctl TIOCSETD: %s", p->tty, strerror(errno));
+    goto ERR;
+  }
+
+  if(p->baud[0])
+  {
+    unsigned char  baud[2] = { p->baud[0], p->baud[1] };
+
+    /* No INNO_XMIT_DELAY_CMD: a per frame delay would keep the driver from
+     * gathering frames into one write.
+     */
+
+    /* tell the driver the bitrates, so "ip -details link show" reports them */
+    if(ioctl(fd, INNO_SET_BAUD_CMD, baud) < 0)
+      emucd_log(LOG_WARNING, "%s: ioctl INNO_SET_BAUD_CMD: %s", p->tty, strerror(errno));
+  }
+
+  /* no rx delay, small tty buffer and short tx batches in the driver */
+  if(p->low_latency && ioctl(fd, INNO_LOW_LATENCY_CMD, 1) < 0)
+    emucd_log(LOG_WARNING, "%s: ioctl INNO_LOW_LATENCY_CMD: %s", p->tty, strerror(errno));
+
+  for(channel = 0; channel < 2; channel++)
+  {
+    /* retrieve the name of the created CAN netdevice */
+    if(ioctl(fd, SIOCGIFNAME, buf) < 0)
+    {
+      emucd_log(LOG_ERR, "%s: ioctl SIOCGIFNAME: %s", p->tty, strerror(errno));
+      goto ERR;
+    }
+
+    /* the driver copies at most IFNAMSIZ bytes, a longer name would be a bad reply */
+    if(snprintf(p->ifname[channel], IFNAMSIZ, "%s", buf) >= IFNAMSIZ)
+    {
+      emucd_log(LOG_ERR, "%s: ioctl SIOCGIFNAME: name too long", p->tty);
+      goto ERR;
+    }
+
+    emucd_log(LOG_NOTICE, "attached TTY %s channel %d to netdevice %s", p->tty, channel, buf);
+
+    /* try to rename the created netdevice, a reattached one may have its name already */
+    if(p->name[channel][0] && strncmp(buf, p->name[channel], IFNAMSIZ))
+    {
+      struct ifreq  ifr;
+      int           s = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+      if(s < 0)
+      {
+        emucd_log(LOG_ERR, "socket for interface rename: %s", strerror(errno));
+        goto ERR;
+      }
+
+      memset(&ifr, 0, sizeof(ifr));
+      strncpy(ifr.ifr_name, p->ifname[channel], IFNAMSIZ - 1);
+      strncpy(ifr.ifr_newname, p->name[channel], IFNAMSIZ - 1);
+
+      if(ioctl(s, SIOCSIFNAME, &ifr) < 0)
+      {
+        emucd_log(LOG_NOTICE, "netdevice %s rename to %s failed: %s", buf, p->name[channel], strerror(errno));
+        close(s);
+        goto ERR;
+      }
+
+      emucd_log(LOG_NOTICE, "netdevice %s renamed to %s", buf, p->name[channel]);
+      snprintf(p->ifname[channel], IFNAMSIZ, "%s", p->name[channel]);
+      close(s);
+    }
+  }
+
+  p->fd = fd;
+  return 0;
+
+ERR:
+  /* the last close of the tty detaches the ldisc again */
+  close(fd);
+  return -1;
+
+} /* END: EMUCPortAttach() */
+
+/*------------------------------------------------------------------------------------*/
+/* Give the tty back to N_TTY and leave the adapter inactive. After a hangup
+ * the ldisc is already gone and only the fd is closed.
+ */
+void EMUCPortDetach (EMUC_PORT *p, int hung_up)
+{
+  int             ldisc = N_TTY;
+  struct termios  tios;
+  EMUC_CMD        cmd;
+
+  if(p->fd < 0)
+    return;
+
+  if(!hung_up)
+  {
+    /* Reset line discipline */
+    emucd_log(LOG_INFO, "stopping on TTY device %s", p->tty);
+
+    if(ioctl(p->fd, TIOCSETD, &ldisc) < 0)
+      emucd_log(LOG_ERR, "%s: ioctl TIOCSETD: %s", p->tty, strerror(errno));
+    else
+    {
+      /* the ldisc deactivated the channels, make sure the device agrees */
+      EMUCCmdInit(&cmd, EMUC_INACTIVE, EMUC_INACTIVE);
+      EMUCRunCmd(p->fd, &cmd, 1, EMUC_CMD_TIMEOUT);
+    }
+
+    /* Reset old rates */
+    if(tcgetattr(p->fd, &tios) == 0)
+    {
+      cfsetispeed(&tios, p->old_ispeed);
+      cfsetospeed(&tios, p->old_ospeed);
+
+      /* apply changes */
+      if(tcsetattr(p->fd, TCSADRAIN, &tios) < 0)
+        emucd_log(LOG_NOTICE, "Cannot set attributes for device \"%s\": %s!", p->tty, strerror(errno));
+    }
+
+    /* Reset the serial flags changed by -L */
+    if(p->old_serial_flags >= 0)
+    {
+      struct serial_struct  ss;
+
+      if(ioctl(p->fd, TIOCGSERIAL, &ss) == 0)
+      {
+        ss.flags = p->old_serial_flags;
+        ioctl(p->fd, TIOCSSERIAL, &ss);
+      }
+    }
+  }
+
+  close(p->fd);
+  p->fd = -1;
+
+} /* END: EMUCPortDetach() */
+
+/*------------------------------------------------------------------------------------*/
+/* "6" sets both channels, "79" channel 1 and channel 2. Returns 0 or -1. */
+int EMUCParseSpeed (const char *speed, int baud[2])
+{
+  char  digit[2] = {0};
+  int   len = strlen(speed);
+  int   i;
+
+  if(len < 1 || len > 2)
+    return -1;
+
+  for(i=0; i<2; i++)
+  {
+    digit[0] = speed[len == 2 ? i : 0];
+    baud[i]  = (int) strtol(digit, NULL, 16);
+
+    if(!EMUCBaudBitrate(baud[i]))
+      return -1;
+  }
+
+  return 0;
+}
+
+/*------------------------------------------------------------------------------------*/
+const char *EMUCSpeedName (int speed)
+{
+  switch (speed)
+  {
+    case 4:   return "100 KBPS";
+    case 5:   return "125 KBPS";
+    case 6:   return "250 KBPS";
+    case 7:   return "500 KBPS";
+    case 8:   return "800 KBPS";
+    case 9:   return "1   MBPS";
+    case 10:  return "400 KBPS";
+    default:  return "unknown";
+  }
+}
+
+
+
+/*------------------------------------------------------------------------------------*/
+/* Whole device setup in one batch. Returns the number of failed commands. */
+static int reset_2_default (int fd, int CAN1_baud, int CAN2_baud)
+{
+  static const char  *names[] = { "init", "clear filter 1", "clear filter 2", "error type", "mode", "baud rate" };
+  EMUC_CMD            cmds[6];
+  int                 failed, i;
+
+  EMUCCmdInit     (&cmds[0], EMUC_INACTIVE, EMUC_INACTIVE);
+  EMUCCmdClrFilter(&cmds[1], EMUC_CAN_1);
+  EMUCCmdClrFilter(&cmds[2], EMUC_CAN_2);
+  EMUCCmdErrType  (&cmds[3], EMUC_DIS_ALL);
+  EMUCCmdMode     (&cmds[4], EMUC_NORMAL, EMUC_NORMAL);
+  EMUCCmdBaud     (&cmds[5], CAN1_baud, CAN2_baud);
+
+  failed = EMUCRunCmd(fd, cmds, 6, EMUC_CMD_TIMEOUT);
+
+  for(i=0; failed && i<6; i++)
+  {
+    if(cmds[i].status == 0)
+      continue;
+
+    if(cmds[i].status < 0)
+      emucd_log(LOG_ERR, "%s: no reply from device", names[i]);
+    else
+      emucd_log(LOG_ERR, "%s: failed with status %d", names[i], cmds[i].status);
+  }
+
+  return failed;
+}
+
+
+
+/*------------------------------------------------------------------------------------*/
+/* ASYNC_LOW_LATENCY: serial drivers that support it hand received bytes on
+ * without their usual delay, e.g. USB serial bridges with a latency timer.
+ * Drivers without TIOCSSERIAL, like cdc-acm and ptys, are left as they are.
+ */
+static void serial_low_latency (EMUC_PORT *p, int fd)
+{
+  struct serial_struct  ss;
+
+  if(ioctl(fd, TIOCGSERIAL, &ss) < 0)
+  {
+    emucd_log(LOG_INFO, "%s: no serial low latency flag: %s", p->tty, strerror(errno));
+    return;
+  }
+
+  if(ss.flags & ASYNC_LOW_LATENCY)
+    return;
+
+  p->old_serial_flags = ss.flags;
+  ss.flags |= ASYNC_LOW_LATENCY;
+
+  if(ioctl(fd, TIOCSSERIAL, &ss) < 0)
+  {
+    emucd_log(LOG_INFO, "%s: no serial low latency flag: %s", p->tty, strerror(errno));
+    p->old_serial_flags = -1;
+  }
+}
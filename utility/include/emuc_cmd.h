@@ -0,0 +1,43 @@
+#ifndef __EMUC_CMD_H__
+#define __EMUC_CMD_H__
+
+#include "emuc_parse.h"
+
+
+#define  VER_LEN            16
+#define  EMUC_CMD_TIMEOUT   1000  /* ms to wait for the replies of one batch */
+
+/*-------------------*/
+typedef struct
+{
+  char   fw   [VER_LEN];
+  char   model[VER_LEN];
+
+} VER_INFO;
+
+/*-------------------*/
+/* one command of a batch and its reply */
+typedef struct
+{
+  unsigned char  cmd  [CMD_MAX_LEN];
+  int            len;
+  unsigned char  reply[CMD_VER_LEN];
+  int            status;  /* reply status byte, 0: ok, -1: no reply */
+
+} EMUC_CMD;
+
+
+/*-------------------*/
+int  EMUCOpenDevice  (const char *tty);
+void EMUCCloseDevice (int fd);
+int  EMUCRunCmd      (int fd, EMUC_CMD *cmds, int cnt, int timeout_ms);
+int  EMUCShowVer     (int fd, VER_INFO *ver_info);
+
+void EMUCCmdInit     (EMUC_CMD *c, int CAN1_sts, int CAN2_sts);
+void EMUCCmdBaud     (EMUC_CMD *c, int CAN1_baud, int CAN2_baud);
+void EMUCCmdMode     (EMUC_CMD *c, int CAN1_mode, int CAN2_mode);
+void EMUCCmdErrType  (EMUC_CMD *c, int err_type);
+void EMUCCmdClrFilter(EMUC_CMD *c, int CAN_port);
+
+
+#endif
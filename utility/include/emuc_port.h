@@ -0,0 +1,63 @@
+#ifndef __EMUC_PORT_H__
+#define __EMUC_PORT_H__
+
+#include <termios.h>
+#include <net/if.h>
+#include <linux/tty.h>
+#include <linux/version.h>
+
+#include "emuc_cmd.h"
+
+
+#define INNO_XMIT_DELAY_CMD 0x14A9
+#define INNO_SET_BAUD_CMD   0x14AA
+#define INNO_LOW_LATENCY_CMD 0x14AB
+
+/*
+ * Ldisc number for emuc.
+ * Beform 3.1.0, the ldisc number is private define
+ * in kernel, usrspace application cannot use it.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,1,0)
+  #define N_EMUC (NR_LDISCS - 1)
+#else
+  #define N_EMUC 17 /* N_SLCAN */
+#endif
+
+#define  TTYPATH_LENGTH   64
+
+/*-------------------*/
+/* one adapter: its tty and the setup applied when attaching it */
+typedef struct
+{
+  char     tty    [TTYPATH_LENGTH];
+  int      baud   [2];              /* CMD_HEAD_BAUD codes, 0: leave the device as it is */
+  char     name   [2][IFNAMSIZ];    /* requested interface names, "": keep the driver's */
+  char     ifname [2][IFNAMSIZ];    /* interface names once attached */
+  int      low_latency;             /* apply the low latency profile */
+  int      fd;                      /* tty with the ldisc attached, -1: none */
+  speed_t  old_ispeed;
+  speed_t  old_ospeed;
+  int      old_serial_flags;        /* serial_struct flags before -L, -1: not changed */
+
+} EMUC_PORT;
+
+
+/*-------------------*/
+int         EMUCPortAttach   (EMUC_PORT *p);
+void        EMUCPortDetach   (EMUC_PORT *p, int hung_up);
+int         EMUCParseSpeed   (const char *speed, int baud[2]);
+const char *EMUCSpeedName    (int speed);
+
+/* supervisor.c */
+int         emucd_supervise  (const char *conf, int low_latency);
+
+/* main.c: syslog when running as a daemon, stdout otherwise */
+void        emucd_log        (int prio, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void        emucd_signal     (void);
+
+extern int  emucd_running;
+extern int  sfd;
+
+
+#endif
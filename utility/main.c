@@ -27,157 +27,73 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <stdarg.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/socket.h>
 #include <fcntl.h>
 #include <syslog.h>
 #include <errno.h>
 #include <pwd.h>
 #include <signal.h>
-#include <sys/ioctl.h>
-#include <net/if.h>
-#include <termios.h>
-#include <linux/tty.h>
-#include <linux/sockios.h>
-#include <linux/version.h>
+#include <libgen.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
 
 #include "version.h"
 
-/*=================================== EMUC library ===================================*/
-#define  RS232_PORTNR  68
-#define  VER_LEN       16
-
-/*-------------------*/
-enum
-{
-  EMUC_CAN_1 = 0,
-  EMUC_CAN_2
-};
-
-/*-------------------*/
-enum
-{
-  EMUC_INACTIVE = 0,
-  EMUC_ACTIVE
-};
-
-/*-------------------*/
-enum
-{
-  EMUC_NORMAL = 0,
-  EMUC_LISTEN
-};
-
-/*-------------------*/
-enum
-{
-  EMUC_DIS_ALL = 0,
-  EMUC_EE_ERR,
-  EMUC_BUS_ERR,
-  EMUC_EN_ALL = 255
-};
-
-/*-------------------*/
-typedef struct
-{
-  char   fw   [VER_LEN];
-  char   api  [VER_LEN];
-  char   model[VER_LEN];
-
-} VER_INFO;
-
-
-extern char *comports [RS232_PORTNR];
-
-extern int EMUCOpenSocketCAN (int com_port);
-extern int EMUCCloseDevice   (int com_port);
-extern int EMUCClearFilter   (int com_port, int CAN_port);
-extern int EMUCSetErrorType  (int com_port, int err_type);
-extern int EMUCShowVer       (int com_port, VER_INFO *ver_info);
-extern int EMUCInitCAN       (int com_port, int CAN1_sts,  int CAN2_sts);
-extern int EMUCSetBaudRate   (int com_port, int CAN1_baud, int CAN2_baud);
-extern int EMUCSetMode       (int com_port, int CAN1_mode, int CAN2_mode);
-/*====================================================================================*/
-
-#define INNO_XMIT_DELAY_CMD 0x14A9
-
-/*
- * Ldisc number for emuc.
- * Beform 3.1.0, the ldisc number is private define
- * in kernel, usrspace application cannot use it.
- */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,1,0)
-  #define N_EMUC (NR_LDISCS - 1)
-#endif
+#include "emuc_port.h"
 
 #define   DAEMON_NAME      "emucd"
-#define   TTYPATH_LENGTH   64
 
-static int  emucd_running;
+int         emucd_running;
+static int  hung_up;
 static int  exit_code;
 static char ttypath [TTYPATH_LENGTH];
 
-static void reset_2_default (int com_port);
+static int  wait_for_tty (int timeout_s);
 static void print_version (char *prg);
 static void print_usage (char *prg);
-static void child_handler (int signum);
-static int look_up_emuc_comport (const char *tty);
-static int check_can_speed_format (const char *speed);
-static const char *look_up_can_speed (int speed);
-static char *look_up_xmit_delay (int speed);
 
 /* global variable (for end process) */
-int             port;
-int             ldisc;
-int             fd;
+int             sfd = -1;     /* signalfd for SIGINT and SIGTERM */
 int             run_as_daemon = 1;
-speed_t         old_ispeed;
-speed_t         old_ospeed;
-struct termios  tios;
 
 /*------------------------------------------------------------------------------------*/
 int main (int argc, char *argv[])
 {
-  int             sp_1;
-  int             sp_2;
   int             opt;
-  int             channel;
-  int             open_com_rtn = 1;
+  int             port;
   int             time_out_int = 0;
   char           *pch;
   char           *tty = NULL;
-  char           *name[2];
+  char           *conf = NULL;
   char           *speed = NULL;
   char           *time_out_ch = NULL; /* in [sec] */
-  char            speed_tmp[2] = {0};
-  char            buf[IFNAMSIZ + 1];
   char const     *devprefix = "/dev/";
-  clock_t         start;
-  clock_t         time_out;
-
-#ifdef N_EMUC
-  ldisc = N_EMUC;
-#else
-  ldisc = 17; /* N_SLCAN */
-#endif
+  sigset_t        sigs;
+  int             ep;
+  EMUC_PORT       emuc;
 
-  name[0] = NULL;
-  name[1] = NULL;
+  memset(&emuc, 0, sizeof(emuc));
   ttypath[0] = '\0';
 
-  while ((opt = getopt(argc, argv, "s:Fvt:h")) != -1)
+  while ((opt = getopt(argc, argv, "s:FLvt:c:h")) != -1)
   {
     switch (opt)
     {
       case 's':
                 speed = optarg;
-                if (check_can_speed_format(speed) < 0)
+                if (EMUCParseSpeed(speed, emuc.baud) < 0)
                   print_usage(argv[0]);
                 break;
       case 'F':
                 run_as_daemon = 0;
                 break;
+      case 'L':
+                emuc.low_latency = 1;
+                break;
       case 'v':
                 if(argc == 3)
                 {
@@ -187,6 +103,9 @@ int main (int argc, char *argv[])
                 time_out_ch = optarg;
                 time_out_int = atoi(time_out_ch);
                 break;
+      case 'c':
+                conf = optarg;
+                break;
       case 'h':
       default:
                 print_usage(argv[0]);
@@ -198,136 +117,83 @@ int main (int argc, char *argv[])
   if(run_as_daemon)
     openlog(DAEMON_NAME, LOG_PID, LOG_LOCAL5);
 
+  /* Signals are read from sfd, in the main loop and while waiting for the tty */
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  sigprocmask(SIG_BLOCK, &sigs, NULL);
+
+  sfd = signalfd(-1, &sigs, SFD_CLOEXEC);
+  if(sfd < 0)
+  {
+    perror("signalfd");
+    exit(EXIT_FAILURE);
+  }
+
+  emucd_running = 1;
+
+  /* Supervisor: all adapters, set up from the config file */
+  if (conf)
+  {
+    /* threads do not survive the fork, daemonize first */
+    if (run_as_daemon && daemon(0, 0))
+    {
+      printf("failed to daemonize!\n");
+      exit(EXIT_FAILURE);
+    }
+
+    exit_code = emucd_supervise(conf, emuc.low_latency);
+
+    if(run_as_daemon)
+      closelog();
+
+    return exit_code;
+  }
+
   /* Parse serial device name and optional can interface name */
   tty = argv[optind];
   if (NULL == tty)
     print_usage(argv[0]);
 
-  name[0] = argv[optind + 1];
-  if (name[0])
-    name[1] = argv[optind + 2];
+  if (argv[optind + 1])
+  {
+    snprintf(emuc.name[0], IFNAMSIZ, "%s", argv[optind + 1]);
+
+    if (argv[optind + 2])
+      snprintf(emuc.name[1], IFNAMSIZ, "%s", argv[optind + 2]);
+  }
 
   /* Prepare the tty device name string */
   pch = strstr(tty, devprefix);
-  if (pch != tty)
+  if (pch != tty && tty[0] != '/')
     snprintf(ttypath, TTYPATH_LENGTH, "%s%s", devprefix, tty);
   else
     snprintf(ttypath, TTYPATH_LENGTH, "%s", tty);
 
-  if(run_as_daemon) syslog(LOG_INFO, "starting on TTY device %s", ttypath);
-  else              printf("starting on TTY device %s\n", ttypath);
-
-  /* Set can spped by EMUC library */
-  if(speed)
-  {
-    port = look_up_emuc_comport(ttypath);
-    
-    if(port < 0)
-    {
-      if(run_as_daemon) syslog(LOG_ERR, "unknown comport");
-      else              printf("unknown comport\n");
-      exit(EXIT_FAILURE);
-    }
+  snprintf(emuc.tty, TTYPATH_LENGTH, "%s", ttypath);
 
-    /* Check if timeout is needed */
-    if(0 == time_out_int)
-    {
-      open_com_rtn = EMUCOpenSocketCAN(port);
-    }
-    else
-    {
-      time_out = (clock_t) time_out_int;
-      time_out = time_out * 1000 * 1000; /* [sec] */
-      start = clock();
-
-      if(run_as_daemon) syslog(LOG_INFO, "set open comport timeout: %d [sec]", time_out_int);
-      else              printf("set open comport timeout: %d [sec]\n", time_out_int);
-
-      while(1)
-      {
-        open_com_rtn = EMUCOpenSocketCAN(port);
-
-        if(clock() > (start + time_out))
-        {
-          if(run_as_daemon) syslog(LOG_ERR, "open comport timeout: %s, %d", ttypath, port);
-          else              printf("open comport timeout: %s, %d\n", ttypath, port);
-          exit(EXIT_FAILURE);
-        }
-        else if(0 == open_com_rtn)
-          break;
-      }
-    }
+  emucd_log(LOG_INFO, "starting on TTY device %s", ttypath);
 
+  /* Check if timeout is needed */
+  if(time_out_int)
+    emucd_log(LOG_INFO, "set open comport timeout: %d [sec]", time_out_int);
 
+  port = wait_for_tty(time_out_int);
 
-    /* open COM port successfully */
-    if(0 == open_com_rtn)
-    {
-      if(run_as_daemon) syslog(LOG_INFO, "open comport successfully: %s, %d", ttypath, port);
-      else              printf("open comport successfully: %s, %d\n", ttypath, port);
-      reset_2_default(port);
-
-      if(strlen(speed) == 2)
-      {
-        speed_tmp[0] = *speed;
-        sp_1 = (int) strtol(speed_tmp, NULL, 16);
-        speed_tmp[0] = *(speed+1);
-        sp_2 = (int) strtol(speed_tmp, NULL, 16);
-        if(0 == EMUCSetBaudRate(port, sp_1, sp_2))
-        {
-          if(run_as_daemon)
-          {
-            syslog(LOG_INFO, "Set can speed to %s on channel 1", look_up_can_speed(sp_1));
-            syslog(LOG_INFO, "Set can speed to %s on channel 2", look_up_can_speed(sp_2));
-          }
-          else
-          {
-            printf("Set can speed to %s on channel 1\n", look_up_can_speed(sp_1));
-            printf("Set can speed to %s on channel 2\n", look_up_can_speed(sp_2));
-          }
-        }
-        else
-        {
-          if(run_as_daemon) syslog(LOG_ERR, "EMUCSetBaudRate() failed!");
-          else              printf("EMUCSetBaudRate() failed!\n");
-          exit(EXIT_FAILURE);
-        }
-      }
-      else
-      {
-        sp_1 = (int) strtol(speed, NULL, 16);
-        if(0 == EMUCSetBaudRate(port, sp_1, sp_1))
-        {
-          if(run_as_daemon) syslog(LOG_INFO, "set can speed to %s on both channel", look_up_can_speed(sp_1));
-          else              printf("set can speed to %s on both channel\n", look_up_can_speed(sp_1));
-        }
-        else
-        {
-          if(run_as_daemon) syslog(LOG_ERR, "EMUCSetBaudRate() failed!");
-          else              printf("EMUCSetBaudRate() failed!\n");
-          exit(EXIT_FAILURE);
-        }
-      }
-
-#if 0 /* emuc active from driver (module version: v2.5) */
-      if(EMUCInitCAN(port, EMUC_ACTIVE, EMUC_ACTIVE))
-      {
-        if(run_as_daemon) syslog(LOG_ERR, "EMUCInitCAN() failed!");
-        else              printf("EMUCInitCAN() failed!\n");
-        exit(EXIT_FAILURE);
-      }
-#endif
-      EMUCCloseDevice(port);
-    }
-    else
-    {
-      if(run_as_daemon) syslog(LOG_ERR, "fail to open comport: %s, %d", ttypath, port);
-      else              printf("fail to open comport: %s, %d\n", ttypath, port);
-      exit(EXIT_FAILURE);
-    }
+  if(port < 0)
+  {
+    emucd_log(LOG_ERR, "fail to open comport: %s: %s", ttypath, strerror(errno));
+    exit(EXIT_FAILURE);
   }
 
-  /* Daemonize */
+  emucd_log(LOG_INFO, "open comport successfully: %s", ttypath);
+  EMUCCloseDevice(port);
+
+  /* Configure the device, attach the line discipline and name the interfaces */
+  if (EMUCPortAttach(&emuc) < 0)
+    exit(EXIT_FAILURE);
+
+  /* Daemonize once the interfaces exist, so whoever started us can use them right away */
   if (run_as_daemon)
   {
     if (daemon(0, 0))
@@ -337,172 +203,188 @@ int main (int argc, char *argv[])
     }
   }
 
-  /* Trap signals that we expect to receive */
-  /* End process */
-  signal(SIGINT, child_handler);
-  signal(SIGTERM, child_handler);
-
-  emucd_running = 1;
-
-  /* Now we are a daemon -- do the work for which we were paid */
-  fd = open(ttypath, O_RDWR | O_NONBLOCK | O_NOCTTY);
+  /* The Big Loop */
+  emucd_log(LOG_INFO, "EMUC-B202 SocketCAN utility ON");
 
-  if (fd < 0)
+  ep = epoll_create1(EPOLL_CLOEXEC);
+  if (ep < 0)
   {
-    if(run_as_daemon) syslog(LOG_NOTICE, "failed to open TTY device %s\n", ttypath);
-    else              printf("failed to open TTY device %s\n", ttypath);
-    perror(ttypath);
+    perror("epoll_create1");
     exit(EXIT_FAILURE);
   }
 
-  /* Configure baud rate */
-  memset(&tios, 0, sizeof(struct termios));
-  if (tcgetattr(fd, &tios) < 0)
   {
-    if(run_as_daemon) syslog(LOG_NOTICE, "failed to get attributes for TTY device %s: %s\n", ttypath, strerror(errno));
-    else              printf("failed to get attributes for TTY device %s: %s\n", ttypath, strerror(errno));
-    exit(EXIT_FAILURE);
-  }
-
-  /* Get old values for later restore */
-  old_ispeed = cfgetispeed(&tios);
-  old_ospeed = cfgetospeed(&tios);
+    struct epoll_event  ev = { .events = EPOLLIN };
 
-  /* Reset UART settings */
-  cfmakeraw(&tios);
-  tios.c_iflag &= ~IXOFF;
-  tios.c_cflag &= ~CRTSCTS;
+    ev.data.fd = sfd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, sfd, &ev);
 
-  /* Baud Rate */
-  cfsetispeed(&tios, B9600);
-  cfsetospeed(&tios, B9600);
-
-  /* apply changes */
-  if (tcsetattr(fd, TCSADRAIN, &tios) < 0)
-  {
-    if(run_as_daemon) syslog(LOG_NOTICE, "Cannot set attributes for device \"%s\": %s!\n", ttypath, strerror(errno));
-    else              printf("Cannot set attributes for device \"%s\": %s!\n", ttypath, strerror(errno));
+    /* the driver reports the adapter going away as EPOLLHUP */
+    ev.data.fd = emuc.fd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, emuc.fd, &ev);
   }
 
-  /* set slcan like discipline on given tty */
-  if (ioctl(fd, TIOCSETD, &ldisc) < 0)
+  while (emucd_running)
   {
-    perror("ioctl TIOCSETD");
-    exit(EXIT_FAILURE);
-  }
+    struct epoll_event  ev;
 
+    if (epoll_wait(ep, &ev, 1, -1) <= 0)
+      continue;
 
-  /* set xmit delay - INNO_XMIT_DELAY_CMD */
-  if(ioctl(fd, INNO_XMIT_DELAY_CMD, look_up_xmit_delay(sp_1)) < 0)
-  {
-    perror("ioctl INNO_XMIT_DELAY_CMD");
-    exit(EXIT_FAILURE);
-  }
-
-  for (channel = 0; channel < 2; channel++)
-  {
-    /* retrieve the name of the created CAN netdevice */
-    if (ioctl(fd, SIOCGIFNAME, buf) < 0)
+    if (ev.data.fd == sfd)
+      emucd_signal();
+    else if (ev.events & (EPOLLHUP | EPOLLERR))
     {
-      perror("ioctl SIOCGIFNAME");
-      exit(EXIT_FAILURE);
+      emucd_log(LOG_NOTICE, "TTY device %s hung up", ttypath);
+      hung_up = 1;
+      exit_code = EXIT_FAILURE;
+      break;
     }
+  }
 
-    if(run_as_daemon) syslog(LOG_NOTICE, "attached TTY %s channel %d to netdevice %s\n", ttypath, channel, buf);
-    else              printf("attached TTY %s channel %d to netdevice %s\n", ttypath, channel, buf);
+  close(ep);
 
-    /* try to rename the created netdevice */
-    if (name[channel])
-    {
-      struct ifreq ifr;
-      int s = socket(PF_INET, SOCK_DGRAM, 0);
-
-      if (s < 0)
-      {
-        perror("socket for interface rename");
-        exit(EXIT_FAILURE);
-      }
-      else
-      {
-        strncpy(ifr.ifr_name, buf, IFNAMSIZ);
-        strncpy(ifr.ifr_newname, name[channel], IFNAMSIZ);
-
-        if (ioctl(s, SIOCSIFNAME, &ifr) < 0)
-        {
-          if(run_as_daemon) syslog(LOG_NOTICE, "netdevice %s rename to %s failed\n", buf, name[channel]);
-          else              printf("netdevice %s rename to %s failed\n", buf, name[channel]);
-          perror("ioctl SIOCSIFNAME rename");
-          exit(EXIT_FAILURE);
-        }
-        else
-        {
-          if(run_as_daemon) syslog(LOG_NOTICE, "netdevice %s renamed to %s\n", buf, name[channel]);
-          else              printf("netdevice %s renamed to %s\n", buf, name[channel]);
-        }
-        close(s);
-      }
-    }
-  }
 
+  /* end process: SIGINT or SIGTERM */
+  /*--------------------------------------------------------------*/
+  /* the adapter is gone, the hangup already detached the ldisc */
+  EMUCPortDetach(&emuc, hung_up);
 
-  /* The Big Loop */
-  if(run_as_daemon) syslog(LOG_INFO, "EMUC-B202 SocketCAN utility ON");
-  else              printf("EMUC-B202 SocketCAN utility ON\n");
-  while (emucd_running)
+  /* Finish up */
+  emucd_log(LOG_NOTICE, "terminated on %s", ttypath);
+
+  if(run_as_daemon)
+    closelog();
+
+  return exit_code;
+  /*--------------------------------------------------------------*/
+
+} /* END: main() */
+
+
+
+/*------------------------------------------------------------------------------------*/
+void emucd_log (int prio, const char *fmt, ...)
+{
+  va_list  ap;
+
+  va_start(ap, fmt);
+
+  if(run_as_daemon)
+    vsyslog(prio, fmt, ap);
+  else
   {
-    sleep(1);
+    vprintf(fmt, ap);
+    printf("\n");
   }
 
+  va_end(ap);
+}
 
-  /* end process: must kill by pkill -2 emucd */
-  /*--------------------------------------------------------------*/
-  /* Reset line discipline */
-  if(run_as_daemon) syslog(LOG_INFO, "stopping on TTY device %s", ttypath);
-  else              printf("stopping on TTY device %s\n", ttypath);
-  ldisc = N_TTY;
-  if (ioctl(fd, TIOCSETD, &ldisc) < 0)
+/*------------------------------------------------------------------------------------*/
+/* read one pending signal from sfd, SIGINT and SIGTERM end the main loop */
+void emucd_signal (void)
+{
+  struct signalfd_siginfo  si;
+
+  if(read(sfd, &si, sizeof(si)) != sizeof(si))
+    return;
+
+  switch (si.ssi_signo)
   {
-    perror("ioctl TIOCSETD");
-    exit(EXIT_FAILURE);
+    case SIGINT:
+    case SIGTERM:
+                  emucd_log(LOG_NOTICE, "received signal %i", si.ssi_signo);
+                  exit_code = EXIT_SUCCESS;
+                  emucd_running = 0;
+                  break;
   }
+}
+
+
+
+/*------------------------------------------------------------------------------------*/
+/* Open ttypath, waiting up to timeout_s seconds for it to show up. udev
+ * creates the node and its symlinks in the watched directory, so the open
+ * is retried on inotify events only. Returns the fd or -1 with errno set.
+ */
+static int wait_for_tty (int timeout_s)
+{
+  char                dir[TTYPATH_LENGTH];
+  int                 com_port, ep, in, tfd, err;
+  int                 retry_ms = -1;
+  struct epoll_event  ev = { .events = EPOLLIN };
+  struct itimerspec   its = { .it_value = { .tv_sec = timeout_s } };
 
-  /* Reset old rates */
-  cfsetispeed(&tios, old_ispeed);
-  cfsetospeed(&tios, old_ospeed);
+  com_port = EMUCOpenDevice(ttypath);
+  if(com_port >= 0 || timeout_s <= 0)
+    return com_port;
 
-  /* apply changes */
-  if (tcsetattr(fd, TCSADRAIN, &tios) < 0)
+  strcpy(dir, ttypath);
+
+  ep  = epoll_create1(EPOLL_CLOEXEC);
+  in  = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+
+  if(ep < 0 || in < 0 || tfd < 0)
   {
-    if(run_as_daemon) syslog(LOG_NOTICE, "Cannot set attributes for device \"%s\": %s!\n", ttypath, strerror(errno));
-    else              printf("Cannot set attributes for device \"%s\": %s!\n", ttypath, strerror(errno));
+    err = errno;
+    goto OUT;
   }
 
-  /* Finish up */
-  if(run_as_daemon) syslog(LOG_NOTICE, "terminated on %s", ttypath);
-  else              printf("terminated on %s\n", ttypath);
+  /* without a directory to watch, e.g. /dev/serial/by-id before the first
+   * adapter, fall back to retrying every 100 ms
+   */
+  if(inotify_add_watch(in, dirname(dir), IN_CREATE | IN_MOVED_TO | IN_ATTRIB) < 0)
+    retry_ms = 100;
 
-  if(run_as_daemon)
-    closelog();
+  timerfd_settime(tfd, 0, &its, NULL);
 
-  EMUCInitCAN(port, EMUC_INACTIVE, EMUC_INACTIVE);
-  EMUCCloseDevice(port);
+  ev.data.fd = sfd;
+  epoll_ctl(ep, EPOLL_CTL_ADD, sfd, &ev);
+  ev.data.fd = in;
+  epoll_ctl(ep, EPOLL_CTL_ADD, in, &ev);
+  ev.data.fd = tfd;
+  epoll_ctl(ep, EPOLL_CTL_ADD, tfd, &ev);
 
-  return exit_code;
-  /*--------------------------------------------------------------*/
+  err = ETIMEDOUT;
 
-} /* END: main() */
+  while(emucd_running)
+  {
+    unsigned char  buf[4096];
 
+    /* it may have shown up before the watch was added */
+    com_port = EMUCOpenDevice(ttypath);
+    if(com_port >= 0)
+      break;
 
+    if(epoll_wait(ep, &ev, 1, retry_ms) <= 0)
+      continue;
 
+    if(ev.data.fd == tfd)
+      break;
 
-/*------------------------------------------------------------------------------------*/
-static void reset_2_default (int com_port)
-{
-  EMUCInitCAN     (com_port, EMUC_INACTIVE, EMUC_INACTIVE);
-  EMUCClearFilter (com_port, EMUC_CAN_1);
-  EMUCClearFilter (com_port, EMUC_CAN_2);
-  EMUCSetErrorType(com_port, EMUC_DIS_ALL);
-  EMUCSetMode     (com_port, EMUC_NORMAL, EMUC_NORMAL);
+    if(ev.data.fd == sfd)
+    {
+      emucd_signal();
+      err = EINTR;
+    }
+    else
+    {
+      /* the events only mean "try again" */
+      while(read(in, buf, sizeof(buf)) > 0);
+    }
+  }
+
+OUT:
+  if(tfd >= 0) close(tfd);
+  if(in  >= 0) close(in);
+  if(ep  >= 0) close(ep);
+
+  if(com_port < 0)
+    errno = err;
+
+  return com_port;
 }
 
 
@@ -514,9 +396,10 @@ static void print_version (char *prg)
   char        *pch;
   char const  *devprefix = "/dev/";
   VER_INFO     ver_info;
+  EMUC_CMD     cmd;
 
   pch = strstr(prg, devprefix);
-  if (pch != prg)
+  if (pch != prg && prg[0] != '/')
   {
     snprintf(ttypath, TTYPATH_LENGTH, "%s%s", devprefix, prg);
   }
@@ -525,24 +408,30 @@ static void print_version (char *prg)
     snprintf(ttypath, TTYPATH_LENGTH, "%s", prg);
   }
 
-  com_port = look_up_emuc_comport(ttypath);
+  /* utility version */
+  fprintf(stdout, "Daemon utility version: %s\n", EMUC_DAEMON_UTILITY_VERSION);
+  fprintf(stdout, "%s\n", "============================");
+
+  com_port = EMUCOpenDevice(ttypath);
 
-  if(com_port != -1)
+  if(com_port < 0)
   {
-    /* utility version */
-    fprintf(stdout, "Daemon utility version: %s\n", EMUC_DAEMON_UTILITY_VERSION);
-    fprintf(stdout, "%s\n", "============================");
-
-    /* api version */
-    EMUCOpenSocketCAN(com_port);
-    EMUCInitCAN(com_port, EMUC_INACTIVE, EMUC_INACTIVE);
-    EMUCShowVer(com_port, &ver_info);
-    fprintf(stdout, "FW ver: %s\n",  ver_info.fw);
-    fprintf(stdout, "LIB ver: %s\n", ver_info.api);
-    fprintf(stdout, "Model: %s\n",   ver_info.model);
+    fprintf(stderr, "fail to open comport: %s: %s\n", ttypath, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  EMUCCmdInit(&cmd, EMUC_INACTIVE, EMUC_INACTIVE);
+  EMUCRunCmd(com_port, &cmd, 1, EMUC_CMD_TIMEOUT);
 
+  if(EMUCShowVer(com_port, &ver_info) == 0)
+  {
+    fprintf(stdout, "FW ver: %s\n", ver_info.fw);
+    fprintf(stdout, "Model: %s\n",  ver_info.model);
   }
+  else
+    fprintf(stdout, "no reply from device\n");
 
+  EMUCCloseDevice(com_port);
   exit(EXIT_SUCCESS);
 }
 
@@ -550,8 +439,9 @@ static void print_version (char *prg)
 /*------------------------------------------------------------------------------------*/
 static void print_usage (char *prg)
 {
-  fprintf(stderr, "\nUsage: %s [options] <tty> [canif-name] [canif2-name]\n\n", prg);
-  fprintf(stderr, "Options: -s <speed>[<speed>] (set CAN speed 3..7)\n");
+  fprintf(stderr, "\nUsage: %s [options] <tty> [canif-name] [canif2-name]\n", prg);
+  fprintf(stderr, "       %s [-F] [-L] -c <config>  (all adapters, see /etc/emucd.conf)\n\n", prg);
+  fprintf(stderr, "Options: -s <speed>[<speed>] (set CAN speed 4..A)\n");
   fprintf(stderr, "                4: 100  KBPS\n");
   fprintf(stderr, "                5: 125  KBPS\n");
   fprintf(stderr, "                6: 250  KBPS\n");
@@ -560,114 +450,19 @@ static void print_usage (char *prg)
   fprintf(stderr, "                9: 1000 KBPS\n");
   fprintf(stderr, "                A: 400  KBPS\n");
   fprintf(stderr, "         -F         (stay in foreground; no daemonize)\n");
+  fprintf(stderr, "         -L         (low latency profile for the tty link)\n");
   fprintf(stderr, "         -h         (show this help page)\n");
   fprintf(stderr, "         -v         (show version info)\n");
   fprintf(stderr, "         -t         (set open tty device timeout [sec])\n");
+  fprintf(stderr, "         -c <file>  (supervisor: attach every adapter as configured in file)\n");
   fprintf(stderr, "\nExamples:\n");
   fprintf(stderr, "emucd_64 -v /dev/ttyACM0\n");
   fprintf(stderr, "emucd_64 -s7 /dev/ttyACM0\n");
   fprintf(stderr, "emucd_64 -s79 /dev/ttyACM0 can0 can1\n");
   fprintf(stderr, "emucd_64 -s79 -t10 /dev/ttyACM0 can0 can1\n");
+  fprintf(stderr, "emucd_64 -L -s9 /dev/ttyACM0\n");
+  fprintf(stderr, "emucd_64 -c /etc/emucd.conf\n");
   fprintf(stderr, "(Note: emucd_32 for 32-bit OS)\n");
   fprintf(stderr, "\n");
   exit(EXIT_FAILURE);
 }
-
-
-/*------------------------------------------------------------------------------------*/
-static void child_handler (int signum)
-{
-  switch (signum)
-  {
-    case SIGUSR1:
-                  /* exit parent */
-                  exit(EXIT_SUCCESS);
-                  break;
-    case SIGALRM:
-    case SIGCHLD:
-                  if(run_as_daemon) syslog(LOG_NOTICE, "received signal %i on %s", signum, ttypath);
-                  else              printf("received signal %i on %s\n", signum, ttypath);
-                  exit_code = EXIT_FAILURE;
-                  emucd_running = 0;
-                  break;
-    case SIGINT:
-    case SIGTERM:
-                  if(run_as_daemon) syslog(LOG_NOTICE, "received signal %i on %s", signum, ttypath);
-                  else              printf("received signal %i on %s\n", signum, ttypath);
-                  exit_code = EXIT_SUCCESS;
-                  emucd_running = 0;
-                  break;
-  }
-}
-
-
-
-/*------------------------------------------------------------------------------------*/
-static int look_up_emuc_comport (const char *tty)
-{
-  int i;
-
-  for(i=0; i<RS232_PORTNR; i++)
-    if(strcmp(tty, comports[i]) == 0)
-      return i;
-
-  return -1; /* invalid port number for EMUC library */
-}
-
-
-
-/*------------------------------------------------------------------------------------*/
-static int check_can_speed_format (const char * speed)
-{
-  int          len;
-  const char  *p;
-
-  len = strlen(speed);
-
-  if(len < 1 || len > 2)
-    return -1;
-
-  for (p = speed; *p == '\0'; p++)
-    if (*p < '3' || *p > '7')
-      return -1;
-
-  return 0;
-}
-
-
-
-/*------------------------------------------------------------------------------------*/
-static const char *look_up_can_speed (int speed)
-{
-  switch (speed)
-  {
-    case 4:   return "100 KBPS";
-    case 5:   return "125 KBPS";
-    case 6:   return "250 KBPS";
-    case 7:   return "500 KBPS";
-    case 8:   return "800 KBPS";
-    case 9:   return "1   MBPS";
-    case 10:  return "400 KBPS";
-    default:  return "unknown";
-  }
-}
-
-
-/*------------------------------------------------------------------------------------*/
-static char *look_up_xmit_delay (int speed)
-{
-  #define TOTAL_BAUD_SELECT 7
-
-  static char xmit_delay_table[TOTAL_BAUD_SELECT][5] =
-  {
-    "500", /* 100K */
-    "400", /* 125K */
-    "300", /* 250K */
-    "200", /* 500K */
-    "150", /* 800K */
-    "100", /* 1M   */
-    "250"  /* 400K */
-  };
-
-  return xmit_delay_table[speed-4];
-}
\ No newline at end of file
@@ -0,0 +1,524 @@
+/*
+ * supervisor.c - one emucd for all EMUC-B202 adapters
+ *
+ * Adapters are found in /sys/class/tty at start and from kernel uevents
+ * afterwards. Each one is set up in its own thread, so several adapters
+ * come up in parallel; the main thread only waits in epoll for signals,
+ * uevents and the hangup of attached ttys.
+ *
+ * Config file, one adapter per line, first match wins:
+ *
+ *   # <adapter>        <speed> [canif-name] [canif2-name]
+ *   port=1-1.2         6       can0 can1
+ *   serial=0123456789  79      can2 can3
+ *   *                  6
+ *
+ * <adapter> is the USB port path (as in /sys/bus/usb/devices), the USB
+ * serial number or * for any other adapter. <speed> is as for emucd -s.
+ *
+ * When the driver had to drop a stalled transmission, the adapter is
+ * attached again, which sets the device up from scratch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <limits.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/sockios.h>
+
+#include "emuc_port.h"
+
+
+#define  EMUCD_MAX_ADAPTERS  16
+#define  EMUCD_MAX_CONF      32
+#define  EMUCD_TXQUEUELEN    1000
+
+#define  EMUC_USB_VENDOR     "04d8"
+#define  EMUC_USB_PRODUCT    "0205"
+
+/* epoll data of the fds that are not adapters */
+#define  EV_SIGNAL           EMUCD_MAX_ADAPTERS
+#define  EV_UEVENT           (EMUCD_MAX_ADAPTERS + 1)
+
+/*-------------------*/
+typedef struct
+{
+  char   match[64];            /* port=<usb port>, serial=<usb serial> or * */
+  int    baud[2];
+  char   name[2][IFNAMSIZ];
+
+} EMUCD_CONF;
+
+enum
+{
+  ADAPTER_FREE = 0,
+  ADAPTER_STARTING,            /* attach thread running */
+  ADAPTER_UP
+};
+
+typedef struct
+{
+  int        state;
+  char       devname[32];      /* ttyACM0 */
+  EMUC_PORT  port;
+
+} EMUCD_ADAPTER;
+
+
+static EMUCD_CONF       conf[EMUCD_MAX_CONF];
+static int              conf_cnt;
+
+/* adapters and starting are protected by lock */
+static EMUCD_ADAPTER    adapters[EMUCD_MAX_ADAPTERS];
+static int              starting;
+static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   started = PTHREAD_COND_INITIALIZER;
+static int              ep = -1;
+static int              low_latency;   /* emucd -L, for every adapter */
+
+static int  read_conf     (const char *path);
+static int  read_attr     (const char *dir, const char *attr, char *buf, int len);
+static int  usb_info      (const char *devname, char *usb_port, char *serial);
+static void start_adapter (const char *devname);
+static void *attach_thread(void *arg);
+static void adapter_gone  (EMUCD_ADAPTER *a);
+static void tx_stalled    (const char *ifname, const char *stall);
+static void if_up         (const char *ifname);
+static void scan_ttys     (void);
+static void read_uevents  (int nl);
+
+
+/*------------------------------------------------------------------------------------*/
+int emucd_supervise (const char *path, int ll)
+{
+  struct sockaddr_nl  snl = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+  struct epoll_event  ev = { .events = EPOLLIN };
+  int                 nl, i;
+
+  if(read_conf(path) < 0)
+    return EXIT_FAILURE;
+
+  low_latency = ll;
+
+  ep = epoll_create1(EPOLL_CLOEXEC);
+  nl = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+
+  if(ep < 0 || nl < 0 || bind(nl, (struct sockaddr *) &snl, sizeof(snl)) < 0)
+  {
+    emucd_log(LOG_ERR, "supervisor setup: %s", strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  ev.data.u64 = EV_SIGNAL;
+  epoll_ctl(ep, EPOLL_CTL_ADD, sfd, &ev);
+  ev.data.u64 = EV_UEVENT;
+  epoll_ctl(ep, EPOLL_CTL_ADD, nl, &ev);
+
+  /* listening already, an adapter plugged in meanwhile is not missed */
+  scan_ttys();
+
+  emucd_log(LOG_INFO, "EMUC-B202 SocketCAN supervisor ON, %d adapter entries in %s", conf_cnt, path);
+
+  while(emucd_running)
+  {
+    if(epoll_wait(ep, &ev, 1, -1) <= 0)
+      continue;
+
+    if(ev.data.u64 == EV_SIGNAL)
+      emucd_signal();
+    else if(ev.data.u64 == EV_UEVENT)
+      read_uevents(nl);
+    else if(ev.events & (EPOLLHUP | EPOLLERR))
+      adapter_gone(&adapters[ev.data.u64]);
+  }
+
+  /* let running attaches finish, then give every tty back */
+  pthread_mutex_lock(&lock);
+  while(starting)
+    pthread_cond_wait(&started, &lock);
+  pthread_mutex_unlock(&lock);
+
+  for(i=0; i<EMUCD_MAX_ADAPTERS; i++)
+  {
+    if(adapters[i].state == ADAPTER_UP)
+    {
+      EMUCPortDetach(&adapters[i].port, 0);
+      adapters[i].state = ADAPTER_FREE;
+    }
+  }
+
+  close(nl);
+  close(ep);
+
+  emucd_log(LOG_NOTICE, "supervisor terminated");
+  return EXIT_SUCCESS;
+
+} /* END: emucd_supervise() */
+
+/*------------------------------------------------------------------------------------*/
+static int read_conf (const char *path)
+{
+  FILE        *f = fopen(path, "re");
+  char         line[256];
+  char         speed[8];
+  int          n, lineno = 0;
+  EMUCD_CONF  *c;
+
+  if(!f)
+  {
+    emucd_log(LOG_ERR, "%s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  while(fgets(line, sizeof(line), f))
+  {
+    lineno++;
+
+    c = &conf[conf_cnt];
+    memset(c, 0, sizeof(EMUCD_CONF));
+
+    n = sscanf(line, "%63s %7s %15s %15s", c->match, speed, c->name[0], c->name[1]);
+    if(n <= 0 || c->match[0] == '#')
+      continue;
+
+    if(n < 2 || EMUCParseSpeed(speed, c->baud) < 0 ||
+       (strncmp(c->match, "port=", 5) && strncmp(c->match, "serial=", 7) && strcmp(c->match, "*")))
+    {
+      emucd_log(LOG_ERR, "%s:%d: invalid entry", path, lineno);
+      fclose(f);
+      return -1;
+    }
+
+    if(conf_cnt == EMUCD_MAX_CONF)
+    {
+      emucd_log(LOG_WARNING, "%s:%d: more than %d entries, ignoring the rest", path, lineno, EMUCD_MAX_CONF);
+      break;
+    }
+
+    conf_cnt++;
+  }
+
+  fclose(f);
+  return 0;
+}
+
+/*------------------------------------------------------------------------------------*/
+/* first line of a sysfs attribute, without the newline */
+static int read_attr (const char *dir, const char *attr, char *buf, int len)
+{
+  char   path[PATH_MAX];
+  FILE  *f;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, attr);
+
+  f = fopen(path, "re");
+  if(!f)
+    return -1;
+
+  if(!fgets(buf, len, f))
+  {
+    fclose(f);
+    return -1;
+  }
+
+  fclose(f);
+  buf[strcspn(buf, "\n")] = '\0';
+  return 0;
+}
+
+/*------------------------------------------------------------------------------------*/
+/* USB port path and serial number of the device behind a tty.
+ * Returns 0 if it is an EMUC-B202.
+ */
+static int usb_info (const char *devname, char *usb_port, char *serial)
+{
+  char  path[PATH_MAX];
+  char  intf[PATH_MAX];
+  char  id[16];
+  char *usb;
+
+  snprintf(path, sizeof(path), "/sys/class/tty/%s/device", devname);
+
+  /* the USB interface, its parent is the USB device */
+  if(!realpath(path, intf))
+    return -1;
+
+  usb = dirname(intf);
+
+  if(read_attr(usb, "idVendor", id, sizeof(id)) || strcmp(id, EMUC_USB_VENDOR) ||
+     read_attr(usb, "idProduct", id, sizeof(id)) || strcmp(id, EMUC_USB_PRODUCT))
+    return -1;
+
+  if(read_attr(usb, "serial", serial, 64))
+    serial[0] = '\0';
+
+  snprintf(usb_port, 64, "%s", basename(usb));
+  return 0;
+}
+
+/*------------------------------------------------------------------------------------*/
+/* attach the adapter on /dev/<devname> in a new thread, if it is configured */
+static void start_adapter (const char *devname)
+{
+  char            usb_port[64];
+  char            serial[64];
+  EMUCD_CONF     *c = NULL;
+  EMUCD_ADAPTER  *a = NULL;
+  pthread_t       thread;
+  int             i;
+
+  if(usb_info(devname, usb_port, serial))
+    return;
+
+  for(i=0; i<conf_cnt && !c; i++)
+  {
+    if((!strncmp(conf[i].match, "port=", 5) && !strcmp(conf[i].match + 5, usb_port)) ||
+       (!strncmp(conf[i].match, "serial=", 7) && !strcmp(conf[i].match + 7, serial)) ||
+       !strcmp(conf[i].match, "*"))
+      c = &conf[i];
+  }
+
+  if(!c)
+  {
+    emucd_log(LOG_INFO, "%s: adapter on port %s, serial %s is not configured", devname, usb_port, serial);
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+
+  for(i=0; i<EMUCD_MAX_ADAPTERS; i++)
+  {
+    /* seen by the initial scan and by a uevent */
+    if(adapters[i].state != ADAPTER_FREE && !strcmp(adapters[i].devname, devname))
+    {
+      pthread_mutex_unlock(&lock);
+      return;
+    }
+
+    if(!a && adapters[i].state == ADAPTER_FREE)
+      a = &adapters[i];
+  }
+
+  if(!a)
+  {
+    pthread_mutex_unlock(&lock);
+    emucd_log(LOG_ERR, "%s: more than %d adapters", devname, EMUCD_MAX_ADAPTERS);
+    return;
+  }
+
+  memset(a, 0, sizeof(EMUCD_ADAPTER));
+  a->state = ADAPTER_STARTING;
+  snprintf(a->devname, sizeof(a->devname), "%s", devname);
+  snprintf(a->port.tty, TTYPATH_LENGTH, "/dev/%s", devname);
+  memcpy(a->port.baud, c->baud, sizeof(c->baud));
+  memcpy(a->port.name, c->name, sizeof(c->name));
+  a->port.low_latency = low_latency;
+  a->port.fd = -1;
+  starting++;
+
+  pthread_mutex_unlock(&lock);
+
+  emucd_log(LOG_INFO, "%s: adapter on port %s, serial %s, matches %s", devname, usb_port, serial, c->match);
+
+  if(pthread_create(&thread, NULL, attach_thread, a))
+  {
+    emucd_log(LOG_ERR, "%s: cannot start a thread", devname);
+
+    pthread_mutex_lock(&lock);
+    a->state = ADAPTER_FREE;
+    if(--starting == 0)
+      pthread_cond_broadcast(&started);
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+
+  pthread_detach(thread);
+}
+
+/*------------------------------------------------------------------------------------*/
+/* The whole bring-up of one adapter, most of it waiting for device replies. */
+static void *attach_thread (void *arg)
+{
+  EMUCD_ADAPTER       *a = arg;
+  struct epoll_event   ev = { .events = EPOLLIN };
+  int                  err = EMUCPortAttach(&a->port);
+
+  if(!err)
+  {
+    if_up(a->port.ifname[0]);
+    if_up(a->port.ifname[1]);
+  }
+
+  pthread_mutex_lock(&lock);
+
+  if(!err)
+  {
+    a->state = ADAPTER_UP;
+
+    /* the driver reports the adapter going away as EPOLLHUP */
+    ev.data.u64 = a - adapters;
+    epoll_ctl(ep, EPOLL_CTL_ADD, a->port.fd, &ev);
+  }
+  else
+    a->state = ADAPTER_FREE;
+
+  if(--starting == 0)
+    pthread_cond_broadcast(&started);
+
+  pthread_mutex_unlock(&lock);
+
+  if(!err)
+    emucd_log(LOG_NOTICE, "%s: %s and %s are up", a->port.tty, a->port.ifname[0], a->port.ifname[1]);
+
+  return NULL;
+}
+
+/*------------------------------------------------------------------------------------*/
+static void adapter_gone (EMUCD_ADAPTER *a)
+{
+  emucd_log(LOG_NOTICE, "TTY device %s hung up", a->port.tty);
+
+  pthread_mutex_lock(&lock);
+  epoll_ctl(ep, EPOLL_CTL_DEL, a->port.fd, NULL);
+  EMUCPortDetach(&a->port, 1);
+  a->state = ADAPTER_FREE;
+  pthread_mutex_unlock(&lock);
+}
+
+/*------------------------------------------------------------------------------------*/
+/* The driver's transmit watchdog fired on ifname. A retry is only logged,
+ * after a reset the adapter is detached and set up again.
+ */
+static void tx_stalled (const char *ifname, const char *stall)
+{
+  EMUCD_ADAPTER  *a = NULL;
+  char            devname[32];
+  int             i;
+
+  pthread_mutex_lock(&lock);
+
+  for(i=0; i<EMUCD_MAX_ADAPTERS && !a; i++)
+  {
+    /* both interfaces report it, the second one finds the adapter restarting */
+    if(adapters[i].state == ADAPTER_UP &&
+       (!strcmp(adapters[i].port.ifname[0], ifname) || !strcmp(adapters[i].port.ifname[1], ifname)))
+      a = &adapters[i];
+  }
+
+  if(!a)
+  {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+
+  emucd_log(LOG_WARNING, "%s: transmit stalled on %s, driver did a %s", a->port.tty, ifname, stall);
+
+  if(strcmp(stall, "reset"))
+  {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+
+  epoll_ctl(ep, EPOLL_CTL_DEL, a->port.fd, NULL);
+  EMUCPortDetach(&a->port, 0);
+  a->state = ADAPTER_FREE;
+  snprintf(devname, sizeof(devname), "%s", a->devname);
+  pthread_mutex_unlock(&lock);
+
+  start_adapter(devname);
+}
+
+/*------------------------------------------------------------------------------------*/
+/* what emuccan.service does with "ip link set canX up qlen 1000" */
+static void if_up (const char *ifname)
+{
+  struct ifreq  ifr;
+  int           s = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+  if(s < 0)
+    return;
+
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+
+  ifr.ifr_qlen = EMUCD_TXQUEUELEN;
+  if(ioctl(s, SIOCSIFTXQLEN, &ifr) < 0)
+    emucd_log(LOG_WARNING, "%s: cannot set qlen: %s", ifname, strerror(errno));
+
+  if(ioctl(s, SIOCGIFFLAGS, &ifr) == 0)
+  {
+    ifr.ifr_flags |= IFF_UP;
+
+    if(ioctl(s, SIOCSIFFLAGS, &ifr) < 0)
+      emucd_log(LOG_WARNING, "%s: cannot set up: %s", ifname, strerror(errno));
+  }
+
+  close(s);
+}
+
+/*------------------------------------------------------------------------------------*/
+static void scan_ttys (void)
+{
+  DIR            *dir = opendir("/sys/class/tty");
+  struct dirent  *de;
+
+  if(!dir)
+    return;
+
+  while((de = readdir(dir)) != NULL)
+  {
+    if(de->d_name[0] != '.')
+      start_adapter(de->d_name);
+  }
+
+  closedir(dir);
+}
+
+/*------------------------------------------------------------------------------------*/
+/* kernel uevents: "add@<devpath>" followed by KEY=value strings */
+static void read_uevents (int nl)
+{
+  char         buf[4096];
+  char        *p;
+  const char  *action, *subsystem, *devname, *ifname, *stall;
+  ssize_t      len;
+
+  while((len = recv(nl, buf, sizeof(buf) - 1, MSG_DONTWAIT)) > 0)
+  {
+    buf[len] = '\0';
+    action = subsystem = devname = ifname = stall = NULL;
+
+    for(p = buf; p < buf + len; p += strlen(p) + 1)
+    {
+      if(!strncmp(p, "ACTION=", 7))
+        action = p + 7;
+      else if(!strncmp(p, "SUBSYSTEM=", 10))
+        subsystem = p + 10;
+      else if(!strncmp(p, "DEVNAME=", 8))
+        devname = p + 8;
+      else if(!strncmp(p, "INTERFACE=", 10))
+        ifname = p + 10;
+      else if(!strncmp(p, "EMUC_TX_STALL=", 14))
+        stall = p + 14;
+    }
+
+    if(!action || !subsystem)
+      continue;
+
+    /* removals show up as the hangup of the attached tty */
+    if(devname && !strcmp(action, "add") && !strcmp(subsystem, "tty"))
+      start_adapter(devname);
+    else if(ifname && stall && !strcmp(action, "change") && !strcmp(subsystem, "net"))
+      tx_stalled(ifname, stall);
+  }
+}